@@ -1,6 +1,7 @@
 #ifndef CACHE_LIGHTS_H
 #define CACHE_LIGHTS_H
 
+#include <cstdint>
 #include <map>
 #include <string>
 #include <vector>
@@ -28,11 +29,15 @@ public:
     // Clear all groups
     void clear();
 
+    // Counter bumped whenever the groups change
+    uint32_t getGeneration() const { return generation; }
+
     // Manually trigger save to NVS
     void saveToNVS();
 
 private:
     std::map<std::string, std::vector<std::string>> groupMap;
+    uint32_t generation = 0;
 
     // Load all groups from NVS
     void loadFromNVS();
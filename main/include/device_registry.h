@@ -0,0 +1,96 @@
+#ifndef DEVICE_REGISTRY_H
+#define DEVICE_REGISTRY_H
+
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "discovery_cache.h"
+#include "http_requester.h"
+
+/**
+ * @brief Known lights, keyed by stable identity rather than by address.
+ *
+ * A light is identified by its MAC address when one is known (mDNS TXT "id"
+ * or accessory-info "macAddress"), otherwise by its mDNS hostname, and as a
+ * last resort by serial number. Incoming information is matched against all
+ * three, so a light that gets a new DHCP lease updates its existing entry's
+ * address in place instead of appearing twice. `DeviceInfo::ip` always holds
+ * the current address.
+ *
+ * Written by the discovery task; read by the HTTP handlers. All methods lock
+ * internally and return copies.
+ */
+class DeviceRegistry {
+public:
+    DeviceRegistry();
+
+    // Register a light assembled from mDNS records, or update the address,
+    // hostname and MAC of the entry it matches. Returns the entry's id.
+    std::string upsert_discovered(const DiscoveredDevice &device);
+
+    // Register a light from its accessory-info (fetched by address), or
+    // update the entry it matches. Returns the entry's id.
+    std::string upsert_info(const DeviceInfo &info);
+
+    // Store accessory-info for the entry `id`, keeping its current address.
+    // Any other entry with the same serial number is folded into this one.
+    void set_info(const std::string &id, const DeviceInfo &info);
+
+    // Forget the device currently at `ip` (TTL expiry or goodbye). Devices
+    // that already moved to a new address are unaffected.
+    void retire_address(const std::string &ip);
+
+    // Current info for the light with this serial number.
+    std::optional<DeviceInfo> find_by_serial(const std::string &serial) const;
+
+    // Id and address of a light still missing accessory-info whose retry
+    // time has come. Returns false if there is none.
+    bool next_to_enrich(int64_t now_us, std::string &id, std::string &ip) const;
+
+    // The accessory-info fetch for `id` failed: do not offer it again for a
+    // while. The wait starts at 5 s and doubles per failure up to 5 minutes.
+    void enrichment_failed(const std::string &id, int64_t now_us);
+
+    // Earliest time next_to_enrich() will have a light to offer, or
+    // INT64_MAX if every light has its accessory-info.
+    int64_t next_enrichment_us() const;
+
+    bool has_address(const std::string &ip) const;
+
+    // Copies of every registered light, in id order. `generation`, if
+    // given, receives the generation() the copies belong to.
+    std::vector<DeviceInfo> all(uint32_t* generation = nullptr) const;
+
+    // Counter bumped whenever what all() returns changes, so a serialized
+    // copy can be reused until it does.
+    uint32_t generation() const;
+
+    size_t size() const;
+
+private:
+    struct Entry {
+        std::string hostname;  // SRV target, empty if never seen over mDNS
+        DeviceInfo info;
+        int64_t enrich_after_us = 0;
+        int enrich_failures = 0;
+    };
+
+    // Find the entry matching any of the given identities. Caller holds the mutex.
+    std::map<std::string, Entry>::iterator find_locked(const std::string &mac, const std::string &hostname,
+                                                       const std::string &serial);
+    // Move the entry under its best id if that changed. Caller holds the mutex.
+    std::map<std::string, Entry>::iterator rekey_locked(std::map<std::string, Entry>::iterator it);
+    void set_address_locked(Entry &entry, const std::string &ip);
+
+    std::map<std::string, Entry> devices;
+    uint32_t changes = 0;        // generation()
+    SemaphoreHandle_t mutex;
+};
+
+#endif // DEVICE_REGISTRY_H
@@ -0,0 +1,170 @@
+#ifndef DISCOVERY_CACHE_H
+#define DISCOVERY_CACHE_H
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+
+/**
+ * @brief A refresh query the mDNS task should send (RFC 6762 section 5.2).
+ */
+struct RefreshQuery {
+    std::string name;
+    uint16_t qtype;
+};
+
+/**
+ * @brief A cached PTR answer to list in an outgoing query's Known-Answer
+ * section (RFC 6762 section 7.1).
+ */
+struct KnownAnswer {
+    std::string instance;
+    uint32_t ttl_remaining_s;
+};
+
+/**
+ * @brief A device assembled from its PTR, SRV, TXT and A records.
+ */
+struct DiscoveredDevice {
+    std::string instance;   // Full instance name, e.g. "Elgato Key Light 1A2B._elg._tcp.local"
+    std::string hostname;   // SRV target
+    std::string ip;         // A record for the SRV target
+    uint16_t port = 0;      // SRV port
+    std::string mac;        // TXT "id"
+    std::string model;      // TXT "md"
+};
+
+/**
+ * @brief A change to the set of reachable lights, pushed by the mDNS task.
+ *
+ * Plain data so it can be copied through a FreeRTOS queue without
+ * allocating. Details are looked up with DiscoveryCache::live_device().
+ */
+struct DiscoveryEvent {
+    enum Type : uint8_t {
+        DEVICE_NEW,      // A hostname we had not seen now resolves to `ip`
+        DEVICE_CHANGED,  // A device moved to `ip`, or its SRV/TXT records changed
+        DEVICE_EXPIRED,  // `ip` is no longer used by any cached hostname
+    };
+    Type type;
+    char ip[16];
+};
+
+/**
+ * @brief Cache of discovered mDNS records with TTL-based expiry.
+ *
+ * Records are keyed by type and name:
+ *  - A records by owner hostname (unique records; a new address replaces the old)
+ *  - PTR records by the instance name they point to (the owner is always the
+ *    watched service, and several instances share it)
+ *  - SRV and TXT records by owner instance name
+ *
+ * Each record expires when its TTL runs out. A goodbye (TTL 0) removes it
+ * immediately. Removing an instance's PTR also removes its SRV, TXT and the
+ * A record of its SRV target. Refresh queries are scheduled at 80%, 85%, 90%
+ * and 95% of the TTL, with 0-2% random jitter, so live devices are
+ * re-confirmed before they expire.
+ *
+ * Changes that matter to the device registry are pushed as DiscoveryEvents
+ * onto a bounded queue, which the consumer blocks on with wait_event(). If
+ * the queue is full the event is dropped and take_overflow() reports it, so
+ * the consumer can resynchronize from live_devices().
+ *
+ * The mDNS task writes; other tasks read. All methods lock internally.
+ */
+class DiscoveryCache {
+public:
+    DiscoveryCache();
+
+    // Insert, refresh or (ttl == 0) remove an A or PTR record. `name` is the
+    // record's owner name; `value` is the IPv4 address (A) or instance name (PTR).
+    void update(uint16_t type, const std::string &name, const std::string &value, uint32_t ttl, int64_t now_us);
+
+    // Insert, refresh or remove an instance's SRV record.
+    void update_srv(const std::string &instance, const std::string &target, uint16_t port, uint32_t ttl, int64_t now_us);
+
+    // Insert, refresh or remove an instance's TXT record ("key=value" strings).
+    void update_txt(const std::string &instance, const std::vector<std::string> &entries, uint32_t ttl, int64_t now_us);
+
+    // True if a record of this type is cached under this owner name (A, SRV,
+    // TXT) or instance name (PTR).
+    bool contains(uint16_t type, const std::string &key) const;
+
+    // Drop records whose TTL has run out.
+    void expire(int64_t now_us);
+
+    // Append the refresh queries that are due and mark them sent.
+    void take_due_refreshes(int64_t now_us, std::vector<RefreshQuery> &out);
+
+    // Earliest time at which expire() or take_due_refreshes() has work to do,
+    // or INT64_MAX if the cache is empty.
+    int64_t next_deadline() const;
+
+    // PTR records whose remaining TTL is still more than half of the
+    // original, i.e. the ones a responder may omit from its answer.
+    void known_answers(int64_t now_us, std::vector<KnownAnswer> &out) const;
+
+    // Incremented whenever a record is added or removed (TTL refreshes of
+    // records already cached do not count).
+    uint32_t generation() const { return record_generation.load(); }
+
+    // Addresses of all live A records.
+    std::set<std::string> live_ips() const;
+
+    // Instances whose SRV target currently resolves to an address, keyed by
+    // that address. TXT fields are filled in when a TXT record is cached.
+    std::map<std::string, DiscoveredDevice> live_devices() const;
+
+    // The device whose SRV target resolves to `ip`, if there is one.
+    std::optional<DiscoveredDevice> live_device(const std::string &ip) const;
+
+    // Block up to `timeout` for the next event. Returns false on timeout.
+    bool wait_event(DiscoveryEvent &event, TickType_t timeout);
+
+    // True (once) if events were dropped because the queue was full.
+    bool take_overflow() { return events_overflowed.exchange(false); }
+
+    size_t size() const;
+
+private:
+    struct Record {
+        std::string name;      // Owner name (hostname for A, service for PTR, instance for SRV/TXT)
+        std::string value;     // IPv4 for A, instance name for PTR, target for SRV
+        uint16_t port = 0;     // SRV only
+        std::vector<std::string> txt; // TXT only
+        uint32_t ttl_s = 0;
+        int64_t received_us = 0;
+        int64_t expires_us = 0;
+        int64_t next_refresh_us = 0;
+        uint8_t refreshes_sent = 0;
+    };
+    using Key = std::pair<uint16_t, std::string>;
+
+    // Find or create the record for `key` and reset its TTL. When ttl is 0,
+    // removes any existing record and returns nullptr. Caller holds the mutex.
+    Record* upsert_locked(const Key &key, uint32_t ttl, int64_t now_us);
+    void erase_locked(const Key &key);
+    void schedule_refresh(Record &rec);
+    bool address_shared_locked(const std::string &ip, const Key &except) const;
+    bool device_from_srv_locked(const Record &srv, DiscoveredDevice &device) const;
+    // Report a change to the device at the instance's SRV target, if it resolves.
+    void push_instance_changed_locked(const std::string &instance);
+    void push_event(DiscoveryEvent::Type type, const std::string &ip);
+
+    std::map<Key, Record> records;
+    std::atomic<uint32_t> record_generation{0};
+    std::atomic<bool> events_overflowed{false};
+    QueueHandle_t events;
+    SemaphoreHandle_t mutex;
+};
+
+#endif // DISCOVERY_CACHE_H
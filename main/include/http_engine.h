@@ -0,0 +1,165 @@
+#ifndef HTTP_ENGINE_H
+#define HTTP_ENGINE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "sdkconfig.h"
+
+/**
+ * @brief Sockets reserved for everything other than light connections: the
+ * mDNS socket, and the HTTP server's listen socket, control socket and
+ * max_open_sockets (4) client sockets.
+ */
+#define HTTP_ENGINE_RESERVED_SOCKETS 7
+
+/**
+ * @brief Maximum number of open connections to lights, so the engine never
+ * takes sockets the rest of the firmware needs. Requests beyond this wait
+ * in the engine for a connection to free up.
+ */
+#if CONFIG_LWIP_MAX_SOCKETS - HTTP_ENGINE_RESERVED_SOCKETS >= 1
+#define HTTP_ENGINE_MAX_CONNECTIONS (CONFIG_LWIP_MAX_SOCKETS - HTTP_ENGINE_RESERVED_SOCKETS)
+#else
+#define HTTP_ENGINE_MAX_CONNECTIONS 1
+#endif
+
+/**
+ * @brief Largest response body accepted. Lights answer with a few hundred
+ * bytes; anything bigger fails the request rather than growing a buffer.
+ */
+#define HTTP_ENGINE_MAX_RESPONSE_BODY 4096
+
+/**
+ * @brief Pass as `timeout_ms` to time the request out from the light's
+ * measured round-trip time instead of a fixed value.
+ */
+#define HTTP_ENGINE_ADAPTIVE_TIMEOUT 0
+
+/**
+ * @brief Longest an adaptive request may take, including waiting for a
+ * connection.
+ */
+#define HTTP_ENGINE_MAX_TIMEOUT_MS 2000
+
+/**
+ * @brief Hedges allowed, as a percentage of hedgeable requests, with a few
+ * saved up for bursts. Keeps hedging from doubling traffic when a whole
+ * floor is slow.
+ */
+#define HTTP_ENGINE_HEDGE_BUDGET_PERCENT 5
+
+enum class HttpEngineMethod : uint8_t {
+    GET,
+    PUT,
+};
+
+/**
+ * @brief Outcome of a request run by the engine.
+ */
+struct HttpEngineResponse {
+    int status = -1;      // HTTP status code, or -1 if no response was received
+    std::string body;
+    std::string error;    // Set when status is -1
+};
+
+/**
+ * @brief Called exactly once per request, on the engine task. Keep it short:
+ * every other request waits while it runs.
+ */
+using HttpEngineCallback = std::function<void(HttpEngineResponse &response)>;
+
+/**
+ * @brief Receives the decoded response body piece by piece, straight from
+ * the receive buffer, on the engine task. When a request has a sink the
+ * body is not collected and HttpEngineResponse::body stays empty.
+ */
+using HttpEngineBodySink = std::function<void(const char *data, size_t len)>;
+
+/**
+ * @brief Round-trip and health figures for one light, for diagnostics.
+ */
+struct HttpEngineHostStats {
+    std::string ip;
+    uint16_t port = 0;
+    uint32_t srtt_ms = 0;          // Smoothed round-trip time
+    uint32_t rttvar_ms = 0;        // Round-trip time variation
+    uint32_t timeout_ms = 0;       // Current adaptive timeout
+    uint32_t samples = 0;          // Round trips measured
+    uint32_t successes = 0;
+    uint32_t failures = 0;         // Timeouts, refused or dropped connections
+    uint32_t rejected = 0;         // Requests failed fast by the circuit breaker
+    int consecutive_failures = 0;
+    bool circuit_open = false;     // Requests are being failed fast
+    int64_t next_probe_us = 0;     // esp_timer time of the next probe, when open
+    uint32_t p95_ms = 0;           // 95th percentile of recent round trips, 0 until known
+    uint32_t hedges = 0;           // Duplicate requests sent
+    uint32_t hedge_wins = 0;       // Duplicates that answered before the original
+};
+
+/**
+ * @brief Starts the engine task. Call once, after the network is up.
+ *
+ * The engine drives every HTTP/1.1 request to the lights from one task and
+ * one select() loop over non-blocking lwIP sockets. Each light gets at most
+ * one keep-alive connection with one request in flight; requests for the
+ * same light queue behind each other, requests for different lights run
+ * concurrently. The light's sockaddr_in and the request preambles for
+ * /elgato/lights are built once per light and reused.
+ *
+ * Connections idle for 20 s are closed, and an idle connection is closed
+ * early when another light needs its socket. If a kept-alive connection was
+ * reset by the light before answering, the request is retried once on a
+ * fresh connection.
+ *
+ * Each light's round-trip time is tracked as a smoothed mean and variation
+ * (RFC 6298). An attempt at an adaptive request times out after SRTT +
+ * 4 * RTTVAR (doubled per timeout in a row) and is retried on a fresh
+ * connection until HTTP_ENGINE_MAX_TIMEOUT_MS has passed. A light whose
+ * requests fail three times in a row gets its requests failed
+ * immediately until a background probe gets an answer; probes back off from
+ * 1 s to 60 s.
+ *
+ * With hedging on (http_engine_set_hedging()), a hedgeable request that has
+ * no answer after the light's 95th percentile round trip is sent again on a
+ * second connection, and whichever connection starts answering first wins;
+ * the other is closed. Hedges are limited to
+ * HTTP_ENGINE_HEDGE_BUDGET_PERCENT of hedgeable requests and need a free
+ * socket.
+ *
+ * @return true if the engine is running.
+ */
+bool http_engine_start();
+
+/**
+ * @brief Queues a request to ip:port. Safe to call from any task, including
+ * from inside a callback.
+ *
+ * @param body Request body (sent as application/json); empty for none.
+ * @param callback Receives the response, or the error once `timeout_ms` has
+ * passed without one.
+ * @param timeout_ms Fixed timeout, or HTTP_ENGINE_ADAPTIVE_TIMEOUT.
+ * @param sink Optional; streams the response body instead of collecting it.
+ * @param hedge The request is idempotent and may be sent twice when hedging
+ * is on.
+ * @return false if the engine is not running; the callback is not called.
+ */
+bool http_engine_submit(const std::string &ip, uint16_t port, HttpEngineMethod method, const std::string &path,
+                        std::string body, HttpEngineCallback callback,
+                        uint32_t timeout_ms = HTTP_ENGINE_ADAPTIVE_TIMEOUT,
+                        HttpEngineBodySink sink = nullptr, bool hedge = false);
+
+/**
+ * @brief Turns hedging of hedgeable requests on or off. Off by default.
+ */
+void http_engine_set_hedging(bool enabled);
+
+/**
+ * @brief Health figures for every light the engine has talked to recently.
+ */
+std::vector<HttpEngineHostStats> http_engine_stats();
+
+#endif // HTTP_ENGINE_H
@@ -4,6 +4,7 @@
 #include <string>
 #include <sstream>
 #include <optional>
+#include <functional>
 
 /**
  * @brief Structure to hold the parsed device information from the JSON response.
@@ -89,6 +90,44 @@ ElgatoLight setLight(const std::string &ip, int brightness, std::optional<int> t
  */
 ElgatoLight getLight(const std::string &ip);
 
+/**
+ * @brief Receives the outcome of an asynchronous light call. Runs on the HTTP
+ * engine task (or on the caller's task if the call fails immediately), so it
+ * must not block.
+ */
+using ElgatoLightCallback = std::function<void(const ElgatoLight &light)>;
+
+/**
+ * @brief Asynchronous setLight(): queues the request on the HTTP engine and
+ * returns at once. `callback` is called exactly once with the updated state
+ * or an error.
+ *
+ * Commands are coalesced per light, latest wins: while an update to the
+ * light is in flight, new commands (from any caller) replace the one waiting
+ * behind it, and everyone waiting gets the state the light reports after the
+ * latest command. setLight() goes through the same path.
+ *
+ * With `read_state` false the light's response body is drained without
+ * being parsed, and on success the callback gets the commanded values
+ * instead of the reported ones (temperature 0 if the command had none).
+ * When coalesced commands disagree, the state is read.
+ */
+void setLightAsync(const std::string &ip, int brightness, std::optional<int> temperature, ElgatoLightCallback callback,
+                   bool read_state = true);
+
+/**
+ * @brief True while an update to `ip` is in flight or waiting behind one,
+ * i.e. the light's last reported state may be about to change.
+ */
+bool lightUpdatePending(const std::string &ip);
+
+/**
+ * @brief Asynchronous getLight(): queues the request on the HTTP engine and
+ * returns at once. `callback` is called exactly once with the current state
+ * or an error.
+ */
+void getLightAsync(const std::string &ip, ElgatoLightCallback callback);
+
 /**
  * @brief Gets the accessory info from an Elgato device.
  *
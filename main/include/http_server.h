@@ -5,6 +5,8 @@
 #include <map>
 #include "http_requester.h"
 #include "cache_lights.h"
+#include "device_registry.h"
+#include "light_state.h"
 
 extern "C" {
     #include "esp_http_server.h"
@@ -13,11 +15,13 @@ extern "C" {
 /**
  * @brief Starts the HTTP server on port 80.
  * 
- * @param device_map Pointer to the map of device IP addresses to DeviceInfo structs.
- * @param device_serial_map Pointer to the map of device serial numbers to DeviceInfo structs.
+ * @param device_registry Pointer to the registry of known lights.
  * @param light_group_cache Pointer to the LightGroupCache instance.
+ * @param light_state Pointer to the light state mirror, served by
+ * GET /lights/state and used to skip redundant commands.
  * @return httpd_handle_t Server handle on success, NULL on failure.
  */
-httpd_handle_t http_server_start(const std::map<std::string, DeviceInfo>* device_map, const std::map<std::string, DeviceInfo>* device_serial_map, LightGroupCache* light_group_cache);
+httpd_handle_t http_server_start(const DeviceRegistry* device_registry, LightGroupCache* light_group_cache,
+                                 LightStateMirror* light_state);
 
 #endif // HTTP_SERVER_H
@@ -0,0 +1,103 @@
+#ifndef JSON_FIELDS_H
+#define JSON_FIELDS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/**
+ * @brief A value to pull out of a JSON document.
+ *
+ * `path` names the value by its keys and array indexes, separated by dots:
+ * "serialNumber" for a top-level key, "lights.0.brightness" for the
+ * brightness of the first element of the "lights" array. Exactly one of
+ * `int_value` and `string_value` is set, and receives the value if it has
+ * that type.
+ */
+struct JsonField {
+    const char* path;
+    int* int_value = nullptr;
+    std::string* string_value = nullptr;
+    bool found = false;   // Set once the value has been stored
+};
+
+/**
+ * @brief Single-pass JSON scanner that fills a fixed set of fields.
+ *
+ * The document is fed in arbitrary pieces as it arrives, so it is never
+ * held in memory whole and no tree is built. Only the values named by
+ * `fields` are kept; everything else is skipped as it streams past. Memory
+ * use is fixed: keys longer than MAX_KEY match nothing, string values
+ * longer than MAX_STRING are truncated, and nesting deeper than MAX_DEPTH
+ * fails the document.
+ *
+ * Numbers are stored truncated to int, as cJSON's valueint would be.
+ */
+class JsonFieldExtractor {
+public:
+    static constexpr size_t MAX_DEPTH = 8;
+    static constexpr size_t MAX_KEY = 32;
+    static constexpr size_t MAX_STRING = 96;
+
+    // `fields` must outlive the extractor.
+    JsonFieldExtractor(JsonField* fields, size_t count);
+
+    // Scan the next piece of the document. Does nothing once failed() is set.
+    void feed(const char* data, size_t len);
+
+    // Call after the last piece. Returns true if the input was exactly one
+    // well-formed JSON value.
+    bool finish();
+
+    bool failed() const { return state == State::FAILED; }
+
+private:
+    enum class State : uint8_t {
+        VALUE,         // Expecting a value
+        VALUE_OR_END,  // After '[': a value or ']'
+        KEY_OR_END,    // After '{': a key or '}'
+        KEY,           // After ',' in an object: a key
+        COLON,
+        AFTER_VALUE,   // Expecting ',' or the closing bracket
+        STRING,        // Inside a string value or key
+        LITERAL,       // Inside a number, true, false or null
+        DONE,          // The top-level value is complete
+        FAILED,
+    };
+
+    struct Frame {
+        bool is_array;
+        uint32_t index;            // Current element, for arrays
+        char key[MAX_KEY + 1];     // Current key, for objects
+        bool key_overflow;         // The key did not fit, so it matches nothing
+    };
+
+    void consume(char c);
+    void begin_value(char c);
+    void end_value();
+    void end_string();
+    void end_literal();
+    void append_string_byte(char c);
+    void append_code_point(uint32_t cp);
+    int match_field() const;
+
+    JsonField* fields;
+    size_t field_count;
+
+    State state = State::VALUE;
+    Frame frames[MAX_DEPTH];
+    size_t depth = 0;          // Open containers
+    bool reading_key = false;  // The STRING being read is an object key
+    int active_field = -1;     // Field the value being read belongs to
+
+    // String decoding
+    bool escape = false;
+    uint8_t unicode_digits = 0;    // Hex digits of a \u escape still to read
+    uint32_t unicode_value = 0;
+    uint32_t high_surrogate = 0;
+    char text[MAX_STRING + 1];     // Current key, string value or literal
+    size_t text_len = 0;
+    bool text_overflow = false;
+};
+
+#endif // JSON_FIELDS_H
@@ -0,0 +1,83 @@
+#ifndef JSON_WRITER_H
+#define JSON_WRITER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <type_traits>
+
+/**
+ * @brief Receives a piece of JSON output. Returns false to stop the writer,
+ * e.g. when the client has gone away.
+ */
+using JsonWriterFlush = std::function<bool(const char *data, size_t len)>;
+
+/**
+ * @brief Compact JSON emitter with a fixed output buffer.
+ *
+ * Output goes into a BUFFER_SIZE buffer that is handed to `flush` whenever
+ * it fills and once more by finish(), so memory use does not depend on the
+ * size of the document. Commas are inserted automatically; the caller is
+ * responsible for balancing begin/end calls and for putting a key() before
+ * every value inside an object.
+ */
+class JsonWriter {
+public:
+    static constexpr size_t BUFFER_SIZE = 256;
+
+    explicit JsonWriter(JsonWriterFlush flush);
+
+    void begin_object();
+    void end_object();
+    void begin_array();
+    void end_array();
+
+    // Object key; the next call writes its value.
+    void key(const char* name);
+
+    void string(const char* value);
+    void string(const std::string &value) { string(value.c_str()); }
+    void number(int64_t value);
+    void boolean(bool value);
+    void null();
+
+    // Key and value in one call
+    void field(const char* name, const char* value) { key(name); string(value); }
+    void field(const char* name, const std::string &value) { key(name); string(value.c_str()); }
+    void field(const char* name, bool value) { key(name); boolean(value); }
+    template <typename T, typename = std::enable_if_t<std::is_integral_v<T> && !std::is_same_v<T, bool>>>
+    void field(const char* name, T value) { key(name); number((int64_t)value); }
+
+    // End a record of newline-delimited JSON; the next value starts a new
+    // record rather than following this one with a comma.
+    void end_record();
+
+    // Hand what is buffered to `flush` now, e.g. to get a partial document
+    // to the client early. Returns false once any flush has failed.
+    bool flush();
+
+    // Flush the rest of the output. Returns false if any flush failed.
+    bool finish() { return flush(); }
+
+    bool failed() const { return failed_flush; }
+
+private:
+    void begin_value();
+    void put(char c);
+    void put(const char* data, size_t len);
+    void put_escaped(const char* value);
+
+    JsonWriterFlush flush_output;
+    char buffer[BUFFER_SIZE];
+    size_t used = 0;
+    bool need_comma = false;     // A value was written at the current level
+    bool failed_flush = false;
+};
+
+/**
+ * @brief Flush function that appends the output to `out`.
+ */
+JsonWriterFlush json_writer_to_string(std::string &out);
+
+#endif // JSON_WRITER_H
@@ -0,0 +1,71 @@
+#ifndef LIGHT_FANOUT_H
+#define LIGHT_FANOUT_H
+
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "http_requester.h"
+#include "light_state.h"
+
+/**
+ * @brief One setLight() call to make as part of a fan-out.
+ */
+struct LightCommand {
+    std::string ip;
+    int brightness = 0;
+    std::optional<int> temperature;
+    ElgatoLight result; // Filled in by fanout_set_lights()
+    bool skipped = false; // The light was already in the requested state
+};
+
+/**
+ * @brief Called with each command as it finishes, on the task that called
+ * fanout_set_lights().
+ */
+using FanoutResultCallback = std::function<void(const LightCommand &command)>;
+
+/**
+ * @brief Runs setLight() for every command concurrently on the HTTP engine
+ * and returns once all have finished. Total latency is that of the slowest
+ * light rather than the sum of all of them.
+ *
+ * With a `mirror`, lights it knows to be in the requested state already are
+ * not sent anything (their `result` is the mirrored state and `skipped` is
+ * set), and every reported state is recorded in it.
+ *
+ * @param commands Commands to run; each one's `result` is filled in.
+ * @param mirror Optional light state mirror.
+ * @param on_result Optional; gets each command as soon as it finishes,
+ * skipped ones first, so results can be reported progressively.
+ */
+void fanout_set_lights(std::vector<LightCommand> &commands, LightStateMirror* mirror = nullptr,
+                       FanoutResultCallback on_result = nullptr);
+
+/**
+ * @brief Outcomes of fire-and-forget commands since boot.
+ */
+struct FanoutAsyncStats {
+    uint32_t queued = 0;
+    uint32_t succeeded = 0;
+    uint32_t failed = 0;
+};
+
+/**
+ * @brief Fire-and-forget fanout_set_lights(): queues every command and
+ * returns without waiting. The lights' responses are drained but not
+ * parsed; each outcome is recorded in `mirror` (as the commanded state,
+ * once the light has accepted it) and counted in fanout_async_stats().
+ *
+ * @param commands Commands to run; `skipped` is set on those not sent
+ * because the mirror shows the light already in the requested state.
+ * @param mirror Optional light state mirror.
+ * @return Number of commands queued.
+ */
+size_t fanout_set_lights_async(std::vector<LightCommand> &commands, LightStateMirror* mirror = nullptr);
+
+FanoutAsyncStats fanout_async_stats();
+
+#endif // LIGHT_FANOUT_H
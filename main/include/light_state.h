@@ -0,0 +1,99 @@
+#ifndef LIGHT_STATE_H
+#define LIGHT_STATE_H
+
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "http_requester.h"
+#include "device_registry.h"
+
+// Poll interval for lights that were recently commanded or changed
+#define LIGHT_POLL_ACTIVE_MS 2000
+// How long a light stays active after a command or outside change
+#define LIGHT_ACTIVE_WINDOW_MS 60000
+// Longest poll interval for idle lights
+#define LIGHT_POLL_IDLE_MAX_MS 30000
+// How long a reported state is trusted to skip a redundant command
+#define LIGHT_STATE_TRUST_MS 15000
+
+/**
+ * @brief Last state reported by one light.
+ */
+struct MirroredLight {
+    ElgatoLight state;
+    bool known = false;          // `state` has been reported at least once
+    bool reachable = false;      // The last command or poll got an answer
+    int64_t confirmed_us = 0;    // When `state` was last reported
+};
+
+/**
+ * @brief In-memory copy of every light's state, keyed by address.
+ *
+ * Updated from the responses to commands and by the background poller
+ * (light_poller_start()). The poller visits a light every
+ * LIGHT_POLL_ACTIVE_MS while it has been commanded or seen to change within
+ * the last LIGHT_ACTIVE_WINDOW_MS; after that its interval doubles up to
+ * LIGHT_POLL_IDLE_MAX_MS.
+ *
+ * All methods lock internally and return copies.
+ */
+class LightStateMirror {
+public:
+    LightStateMirror();
+
+    // Record a state the light reported. `commanded` is set for responses to
+    // our own commands; a poll that finds a different state than recorded is
+    // treated as a change made elsewhere.
+    void record(const std::string &ip, const ElgatoLight &state, bool commanded);
+
+    // Note that the light at `ip` did not answer a command or poll.
+    void record_failure(const std::string &ip);
+
+    // True if the light was confirmed within LIGHT_STATE_TRUST_MS to already
+    // be at this brightness (and temperature, if given), so a command to set
+    // it would change nothing. Brightness 0 matches any light that is off.
+    bool matches(const std::string &ip, int brightness, std::optional<int> temperature) const;
+
+    std::optional<MirroredLight> get(const std::string &ip) const;
+
+    // Track exactly these addresses: new ones are polled right away, others
+    // are dropped.
+    void track(const std::vector<std::string> &ips);
+
+    // Address of a light due for a poll, which is then considered in
+    // progress until record() or record_failure(). Returns false if none is
+    // due or a poll is already running.
+    bool next_to_poll(int64_t now_us, std::string &ip);
+
+    // Earliest time next_to_poll() may offer a light, or INT64_MAX.
+    int64_t next_poll_us() const;
+
+private:
+    struct Entry {
+        MirroredLight light;
+        int64_t touched_us = 0;      // Last command or outside change
+        int64_t interval_us = 0;
+        int64_t next_poll_us = 0;
+        bool polling = false;
+    };
+
+    void schedule_locked(Entry &entry, int64_t now_us);
+
+    std::map<std::string, Entry> lights;
+    int polls_in_flight = 0;
+    SemaphoreHandle_t mutex;
+};
+
+/**
+ * @brief Starts the task that keeps `mirror` current by polling the lights
+ * in `device_registry`.
+ */
+void light_poller_start(const DeviceRegistry* device_registry, LightStateMirror* mirror);
+
+#endif // LIGHT_STATE_H
@@ -0,0 +1,184 @@
+// Fixed-capacity DNS/mDNS packet builder
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Largest packet we ever build on the transmit side. Everything we send
+// (queries, our own announcement, A record answers) fits comfortably in a
+// single 512-byte DNS message, so callers can keep the buffer on the stack.
+static const size_t MDNS_MAX_TX_PACKET = 512;
+
+// DNS record types used by the mDNS code.
+static const uint16_t MDNS_TYPE_A = 1;
+static const uint16_t MDNS_TYPE_PTR = 12;
+static const uint16_t MDNS_TYPE_TXT = 16;
+static const uint16_t MDNS_TYPE_SRV = 33;
+static const uint16_t MDNS_TYPE_ANY = 255;
+
+// DNS classes, including the mDNS cache-flush bit (top bit of rrclass).
+static const uint16_t MDNS_CLASS_IN = 0x0001;
+static const uint16_t MDNS_CLASS_FLUSH = 0x8000;
+
+// Header flags for an authoritative mDNS response.
+static const uint16_t MDNS_FLAGS_RESPONSE = 0x8400;
+
+// Truncated bit. In an mDNS query it means more Known-Answer records follow
+// in the next packet (RFC 6762 section 7.2).
+static const uint16_t MDNS_FLAGS_TC = 0x0200;
+
+// Maximum encoded length of a DNS name (RFC 1035 section 2.3.4).
+static const size_t MDNS_MAX_NAME_WIRE = 255;
+
+// Writes a DNS message straight into a caller-supplied buffer.
+//
+// Names are passed in dotted form ("esp32.local") and are emitted with
+// RFC 1035 section 4.1.4 compression: every label written is remembered,
+// and any later name whose suffix matches an earlier one is terminated with
+// a two-byte pointer instead of repeating the labels.
+//
+// The writer never allocates. If the buffer runs out of space it stops
+// writing and ok() returns false; callers check once before sending.
+class MdnsPacketWriter {
+public:
+    MdnsPacketWriter(uint8_t* buf, size_t capacity);
+
+    // Write the 12-byte header. ID is always 0 for mDNS.
+    void header(uint16_t flags, uint16_t qdcount, uint16_t ancount, uint16_t nscount, uint16_t arcount);
+
+    void put_u8(uint8_t val);
+    void put_u16(uint16_t val);
+    void put_u32(uint32_t val);
+    void put_bytes(const void* data, size_t len);
+
+    // Write a dotted name, compressing against names already in the packet.
+    void put_name(std::string_view name);
+
+    // Write a question entry.
+    void put_question(std::string_view name, uint16_t qtype, uint16_t qclass);
+
+    // Start a resource record: owner name, type, class, TTL and an RDLENGTH
+    // placeholder. Returns a handle to pass to end_record() once the RDATA
+    // has been written; end_record() patches in the real RDLENGTH.
+    size_t begin_record(std::string_view name, uint16_t type, uint16_t rrclass, uint32_t ttl);
+    void end_record(size_t handle);
+
+    // Patch a 16-bit field that was already written (e.g. a header count).
+    void patch_u16(size_t offset, uint16_t val);
+
+    // Save the current write position, and later discard everything written
+    // after it (including an overflow). Lets callers add optional records
+    // until the packet is full.
+    struct Mark {
+        size_t len;
+        size_t label_count;
+    };
+    Mark mark() const { return {len_, label_count_}; }
+    void rollback(const Mark &m);
+
+    bool ok() const { return !overflow_; }
+    size_t size() const { return len_; }
+    const uint8_t* data() const { return buf_; }
+
+private:
+    // Max number of label offsets remembered for compression. Our packets
+    // contain at most a handful of names, each a few labels long.
+    static const size_t MAX_LABELS = 24;
+
+    bool reserve(size_t n);
+    size_t find_suffix(std::string_view suffix) const;
+    void remember_label(size_t offset);
+
+    uint8_t* buf_;
+    size_t cap_;
+    size_t len_ = 0;
+    bool overflow_ = false;
+    uint16_t labels_[MAX_LABELS];
+    size_t label_count_ = 0;
+};
+
+// A dotted name pre-encoded in DNS wire format (length-prefixed labels,
+// zero terminated). Built once for the names we watch so incoming packets
+// can be matched in place without materializing strings.
+struct MdnsWireName {
+    uint8_t data[MDNS_MAX_NAME_WIRE];
+    size_t len = 0;
+
+    // Encode `dotted`. A trailing dot is accepted. Returns false if the name
+    // is empty or too long, in which case nothing will match it.
+    bool set(std::string_view dotted);
+    bool empty() const { return len == 0; }
+};
+
+// A question entry as located in a received packet. Names are kept as
+// offsets into the packet and only decoded on demand.
+struct MdnsQuestion {
+    size_t name_offset;
+    uint16_t qtype;
+    uint16_t qclass;
+};
+
+// A resource record as located in a received packet.
+struct MdnsRecord {
+    size_t name_offset;
+    uint16_t type;
+    uint16_t rrclass;
+    uint32_t ttl;
+    size_t rdata_offset;
+    uint16_t rdlength;
+};
+
+// Walks a received DNS message without allocating. Questions must be read
+// (or skipped) before records; next_record() iterates the answer, authority
+// and additional sections in order.
+class MdnsPacketReader {
+public:
+    MdnsPacketReader(const uint8_t* msg, size_t len);
+
+    // False if the packet is too short to hold a DNS header.
+    bool valid() const { return len_ >= 12; }
+    bool is_response() const { return (flags_ & 0x8000) != 0; }
+    uint16_t flags() const { return flags_; }
+    uint16_t question_count() const { return qdcount_; }
+    uint16_t record_count() const { return rrcount_; }
+
+    // Return the next question, or false when there are no more or the
+    // packet is malformed.
+    bool next_question(MdnsQuestion &q);
+
+    // Return the next resource record. Skips any unread questions first.
+    bool next_record(MdnsRecord &rr);
+
+    // Case-insensitive comparison of the name at `offset` against `name`,
+    // following compression pointers.
+    bool name_equals(size_t offset, const MdnsWireName &name) const;
+
+    // Like name_equals(), but ignores the first label of the name at
+    // `offset`. Used to recognise "<instance>.<service>" owner names.
+    bool parent_equals(size_t offset, const MdnsWireName &name) const;
+
+    // Decode the name at `offset` into dotted form (no trailing dot). Only
+    // use this for names we actually keep. Returns false if malformed.
+    bool read_name(size_t offset, std::string &out) const;
+
+    const uint8_t* data() const { return msg_; }
+    size_t size() const { return len_; }
+
+    // True once reading a question or record ran into a malformed entry.
+    bool malformed() const { return malformed_; }
+
+private:
+    bool skip_name(size_t &offset) const;
+
+    const uint8_t* msg_;
+    size_t len_;
+    size_t offset_ = 12;
+    uint16_t flags_ = 0;
+    uint16_t qdcount_ = 0;
+    uint16_t rrcount_ = 0;
+    uint16_t questions_read_ = 0;
+    uint16_t records_read_ = 0;
+    bool malformed_ = false;
+};
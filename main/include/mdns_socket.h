@@ -8,15 +8,18 @@
 
 #include <string>
 #include <set>
+#include <vector>
+
+#include "mdns_packet.h"
+#include "discovery_cache.h"
 
 // Configuration passed to the mDNS socket task.
-// Contains the socket descriptor and a pointer to a set for discovered IPv4
-// addresses. The task will insert discovered IPv4 addresses into the set
-// pointed to by `set_ip`. This allows the caller to provide a shared
-// set (for example a global) that the task updates.
+// Contains the socket descriptor and a pointer to the caller-owned discovery
+// cache. The task records the A and PTR records it sees (with their TTLs) in
+// the cache, expires them and sends the refresh queries the cache asks for.
 struct TaskConfiguration {
 	int sock_mdns;
-	std::set<std::string>* found_elgato_devices_ips; // pointer to caller-owned set
+	DiscoveryCache* discovery_cache; // pointer to caller-owned cache
 
 	// Optional filter: only insert A records whose DNS name matches this
 	// qname. If empty, all A records are accepted. The value should be a
@@ -26,17 +29,47 @@ struct TaskConfiguration {
 	// For responder functionality
 	std::string mdns_hostname; // Our hostname to respond to queries for
 	std::string our_ip;       // Our IP address to respond with
+
+	// Service we advertise in the periodic announcement
+	std::string service_type = "_http._tcp.local";
+	std::string instance_name = "ESP32 Elgato Light Control";
+	uint16_t service_port = 80;
+
+	// Timer periods run by mdns_socket_run(). Discovery queries start at 1 s
+	// and double up to max_query_interval_ms (RFC 6762 section 5.2).
+	uint32_t announce_interval_ms = 30000;
+	uint32_t max_query_interval_ms = 60 * 60 * 1000;
+
+	// Wire-format copies of `qname`, `mdns_hostname`, `service_type` and
+	// the full "<instance_name>.<service_type>", matched against incoming
+	// packets in place. Filled in by prepare().
+	MdnsWireName qname_wire;
+	MdnsWireName hostname_wire;
+	MdnsWireName service_wire;
+	MdnsWireName instance_wire;
+
+	// Precompute the wire-format names. Call after setting the names above,
+	// before calling mdns_socket_run(). The configuration, `our_ip`
+	// included, is read by the mDNS task without locking and must not be
+	// changed once the task is running.
+	void prepare();
 };
 
 // Returns a bound UDP socket file descriptor joined to the mDNS multicast
-// group on all interfaces, or -1 on error.
-int mdns_setup_socket();
+// group, or -1 on error. When `interface_ip` is given, the group is joined
+// and multicasts are sent on that interface only. Multicast loopback is
+// disabled so we do not parse our own packets.
+int mdns_setup_socket(const std::string &interface_ip = "");
 
 // Send a PTR query for the provided `qname` using the provided socket.
 // If `qname` is empty the default `_elg._tcp.local` is used.
 // Returns number of bytes sent or -1 on error.
 ssize_t send_mdns_ptr_query(const int &sock_mdns, const std::string &qname);
 
+// Send a single-question query for `name` with the given record type.
+// Returns number of bytes sent or -1 on error.
+ssize_t send_mdns_query(const int &sock_mdns, const std::string &name, uint16_t qtype);
+
 // Broadcast an mDNS service announcement (unsolicited response).
 // This advertises your service on the network using the same mDNS socket.
 // service_type: e.g., "_http._tcp.local"
@@ -58,12 +91,35 @@ ssize_t send_mdns_announcement(const int &sock_mdns, const std::string &service_
 // Returns number of bytes sent or -1 on error.
 ssize_t send_mdns_a_record(const int &sock_mdns, const std::string &hostname, const std::string &ipv4_addr);
 
-// Unified mDNS socket task that handles both service discovery and query responses.
-// This ensures a single thread processes all mDNS socket traffic without conflicts.
-// sock_mdns: the mDNS socket
-// qname: service type to discover (e.g., "_elg._tcp.local")
-// set_ip: set to store discovered IP addresses
-// our_hostname: our hostname to respond to queries for (e.g., "esp32-elights.local")
-// our_ip: our IP address to respond with
-void mdns_socket_task(const int &sock_mdns, const std::string &qname, std::set<std::string> &set_ip,
-                      const std::string &our_hostname, const std::string &our_ip);
\ No newline at end of file
+// Counters kept by the mDNS reactor. Each field is a single aligned word
+// written only by the reactor task, so other tasks may read a copy without
+// locking (values may be one update stale).
+struct MdnsStats {
+	uint32_t wakeups;               // select() returns with the socket readable
+	uint32_t packets;               // datagrams received
+	uint32_t last_packets_per_wakeup;
+	uint32_t max_packets_per_wakeup;
+	uint32_t drain_cap_hits;        // wakeups that hit the per-wakeup drain cap (not a drop)
+	uint32_t dropped_malformed;     // too short, or a question or record failed to parse
+	uint32_t dropped_self;          // our own packets looped back
+	uint32_t dropped_rate_limited;  // over a source's token bucket
+	uint32_t recv_errors;
+	uint32_t send_errors;
+	uint32_t responses_sent;        // answers and announcements (multicast and unicast)
+	uint32_t responses_suppressed;  // queries whose known answers already covered us
+	uint32_t responses_deferred;    // multicast answers held until 1 s after the last one
+	uint32_t responses_rate_limited; // multicast answers dropped: already pending, or no slot to wait in
+};
+
+// Unified mDNS reactor that handles service discovery, query responses and
+// the periodic announce/query timers on a single socket, from a single task.
+// Queries for our service (PTR), instance (SRV/TXT) or hostname (A) are
+// answered from pre-serialized packets; shared PTR answers are delayed by a
+// random 20-120 ms and QU questions get a unicast reply (RFC 6762 section 6).
+// Blocks in select() until the socket is readable or the next timer is due,
+// then drains every pending datagram before sleeping again. Never returns.
+// `config` must have been prepared.
+void mdns_socket_run(TaskConfiguration &config);
+
+// Snapshot of the reactor counters.
+MdnsStats mdns_get_stats();
@@ -13,6 +13,7 @@ void LightGroupCache::init() {
 void LightGroupCache::addGroup(const std::string &groupName, const std::vector<std::string> &serialNumbers, bool saveToNVS) {
     ESP_LOGI(TAG, "Adding group '%s' with %d devices", groupName.c_str(), serialNumbers.size());
     groupMap[groupName] = serialNumbers;
+    generation++;
     ESP_LOGI(TAG, "Group map now has %d groups", groupMap.size());
     if (saveToNVS) {
         this->saveToNVS();
@@ -24,6 +25,7 @@ void LightGroupCache::addGroup(const std::string &groupName, const std::vector<s
 
 void LightGroupCache::removeGroup(const std::string &groupName) {
     groupMap.erase(groupName);
+    generation++;
     saveToNVS();
 }
 
@@ -45,6 +47,7 @@ std::map<std::string, std::vector<std::string>> LightGroupCache::getAllGroups()
 
 void LightGroupCache::clear() {
     groupMap.clear();
+    generation++;
     saveToNVS();
 }
 
@@ -89,6 +92,7 @@ std::string LightGroupCache::serializeGroups() const {
 
 void LightGroupCache::deserializeGroups(const std::string &data) {
     groupMap.clear();
+    generation++;
 
     std::istringstream iss(data);
     std::string groupEntry;
@@ -0,0 +1,297 @@
+#include <algorithm>
+#include <cctype>
+#include <climits>
+#include <strings.h>
+
+#include "esp_log.h"
+
+#include "device_registry.h"
+
+static const char* TAG = "DEVICE_REGISTRY";
+
+// Canonical form of a MAC address: 12 upper-case hex digits, separators
+// dropped. Returns empty if `mac` is not a MAC address.
+static std::string normalize_mac(const std::string &mac) {
+    std::string out;
+    for (char c : mac) {
+        if (std::isxdigit((unsigned char)c)) out += (char)std::toupper((unsigned char)c);
+    }
+    return out.size() == 12 ? out : "";
+}
+
+static std::string lowercase(std::string s) {
+    std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c) { return std::tolower(c); });
+    return s;
+}
+
+// Best available identity: MAC, then mDNS hostname, then serial, then address.
+static std::string make_id(const std::string &hostname, const DeviceInfo &info) {
+    std::string mac = normalize_mac(info.macAddress);
+    if (!mac.empty()) return mac;
+    if (!hostname.empty()) return lowercase(hostname);
+    if (!info.serialNumber.empty()) return info.serialNumber;
+    return info.ip;
+}
+
+// Whether two entries would be listed the same by all().
+static bool same_info(const DeviceInfo &a, const DeviceInfo &b) {
+    return a.ip == b.ip && a.productName == b.productName && a.hardwareBoardType == b.hardwareBoardType &&
+           a.hardwareRevision == b.hardwareRevision && a.macAddress == b.macAddress &&
+           a.firmwareBuildNumber == b.firmwareBuildNumber && a.firmwareVersion == b.firmwareVersion &&
+           a.serialNumber == b.serialNumber && a.displayName == b.displayName;
+}
+
+DeviceRegistry::DeviceRegistry() {
+    mutex = xSemaphoreCreateMutex();
+}
+
+std::map<std::string, DeviceRegistry::Entry>::iterator
+DeviceRegistry::find_locked(const std::string &mac, const std::string &hostname, const std::string &serial) {
+    for (auto it = devices.begin(); it != devices.end(); ++it) {
+        const Entry &entry = it->second;
+        if ((!mac.empty() && normalize_mac(entry.info.macAddress) == mac) ||
+            (!hostname.empty() && strcasecmp(entry.hostname.c_str(), hostname.c_str()) == 0) ||
+            (!serial.empty() && entry.info.serialNumber == serial)) {
+            return it;
+        }
+    }
+    return devices.end();
+}
+
+std::map<std::string, DeviceRegistry::Entry>::iterator
+DeviceRegistry::rekey_locked(std::map<std::string, Entry>::iterator it) {
+    std::string id = make_id(it->second.hostname, it->second.info);
+    if (id == it->first) return it;
+
+    changes++;
+    Entry entry = std::move(it->second);
+    devices.erase(it);
+    devices.erase(id); // A stale duplicate of the same light
+    return devices.emplace(id, std::move(entry)).first;
+}
+
+// Move `entry` to `ip`. Whatever else was registered at that address has
+// lost its lease to this light, so it is dropped rather than left pointing
+// commands at the wrong device. Caller holds the mutex.
+void DeviceRegistry::set_address_locked(Entry &entry, const std::string &ip) {
+    if (ip.empty() || entry.info.ip == ip) return;
+
+    for (auto it = devices.begin(); it != devices.end();) {
+        if (&it->second != &entry && it->second.info.ip == ip) {
+            ESP_LOGI(TAG, "Dropping %s, its address %s now belongs to another light", it->first.c_str(), ip.c_str());
+            it = devices.erase(it);
+            changes++;
+        } else {
+            ++it;
+        }
+    }
+    if (!entry.info.ip.empty()) {
+        ESP_LOGI(TAG, "%s moved from %s to %s", entry.info.displayName.c_str(), entry.info.ip.c_str(), ip.c_str());
+    }
+    entry.info.ip = ip;
+    changes++;
+
+    // A new address is worth trying straight away
+    entry.enrich_after_us = 0;
+    entry.enrich_failures = 0;
+}
+
+std::string DeviceRegistry::upsert_discovered(const DiscoveredDevice &device) {
+    xSemaphoreTake(mutex, portMAX_DELAY);
+
+    auto it = find_locked(normalize_mac(device.mac), device.hostname, "");
+    if (it == devices.end()) {
+        // The serial number is not advertised, so it stays empty until the
+        // accessory-info fetch fills it in
+        Entry entry;
+        entry.hostname = device.hostname;
+        entry.info.macAddress = device.mac;
+        entry.info.productName = device.model;
+        entry.info.displayName = device.instance.substr(0, device.instance.find('.'));
+        set_address_locked(entry, device.ip);
+        std::string id = make_id(entry.hostname, entry.info);
+        it = devices.insert_or_assign(id, std::move(entry)).first;
+        changes++;
+        ESP_LOGI(TAG, "Registered %s (%s) from mDNS", device.instance.c_str(), device.ip.c_str());
+    } else {
+        Entry &entry = it->second;
+        entry.hostname = device.hostname;
+        if (entry.info.macAddress.empty()) {
+            entry.info.macAddress = device.mac;
+            changes++;
+        }
+        if (entry.info.productName.empty()) {
+            entry.info.productName = device.model;
+            changes++;
+        }
+        set_address_locked(entry, device.ip);
+        it = rekey_locked(it);
+    }
+
+    std::string id = it->first;
+    xSemaphoreGive(mutex);
+    return id;
+}
+
+std::string DeviceRegistry::upsert_info(const DeviceInfo &info) {
+    xSemaphoreTake(mutex, portMAX_DELAY);
+
+    auto it = find_locked(normalize_mac(info.macAddress), "", info.serialNumber);
+    if (it == devices.end()) {
+        Entry entry;
+        entry.info = info;
+        entry.info.ip.clear();
+        set_address_locked(entry, info.ip);
+        std::string id = make_id(entry.hostname, entry.info);
+        it = devices.insert_or_assign(id, std::move(entry)).first;
+        changes++;
+        ESP_LOGI(TAG, "Registered %s (%s)", info.serialNumber.c_str(), info.ip.c_str());
+    } else {
+        Entry &entry = it->second;
+        std::string ip = entry.info.ip;
+        if (!same_info(entry.info, info)) changes++;
+        entry.info = info;
+        entry.info.ip = ip;
+        set_address_locked(entry, info.ip);
+        it = rekey_locked(it);
+    }
+
+    std::string id = it->first;
+    xSemaphoreGive(mutex);
+    return id;
+}
+
+void DeviceRegistry::set_info(const std::string &id, const DeviceInfo &info) {
+    xSemaphoreTake(mutex, portMAX_DELAY);
+
+    auto it = devices.find(id);
+    if (it != devices.end()) {
+        Entry &entry = it->second;
+        std::string ip = entry.info.ip;
+        DeviceInfo updated = info;
+        updated.ip = ip;
+        if (!same_info(entry.info, updated)) changes++;
+        entry.info = updated;
+
+        // Fold in any entry that turns out to be the same light
+        std::string mac = normalize_mac(info.macAddress);
+        for (auto other = devices.begin(); other != devices.end();) {
+            if (other != it && ((!info.serialNumber.empty() && other->second.info.serialNumber == info.serialNumber) ||
+                                (!mac.empty() && normalize_mac(other->second.info.macAddress) == mac))) {
+                other = devices.erase(other);
+                changes++;
+            } else {
+                ++other;
+            }
+        }
+        rekey_locked(it);
+    }
+
+    xSemaphoreGive(mutex);
+}
+
+void DeviceRegistry::retire_address(const std::string &ip) {
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    for (auto it = devices.begin(); it != devices.end();) {
+        if (it->second.info.ip == ip) {
+            ESP_LOGI(TAG, "Removed device %s (%s)", it->second.info.serialNumber.c_str(), ip.c_str());
+            it = devices.erase(it);
+            changes++;
+        } else {
+            ++it;
+        }
+    }
+    xSemaphoreGive(mutex);
+}
+
+std::optional<DeviceInfo> DeviceRegistry::find_by_serial(const std::string &serial) const {
+    std::optional<DeviceInfo> found;
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    for (const auto &entry : devices) {
+        if (entry.second.info.serialNumber == serial) {
+            found = entry.second.info;
+            break;
+        }
+    }
+    xSemaphoreGive(mutex);
+    return found;
+}
+
+bool DeviceRegistry::next_to_enrich(int64_t now_us, std::string &id, std::string &ip) const {
+    bool found = false;
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    for (const auto &entry : devices) {
+        if (entry.second.info.serialNumber.empty() && entry.second.enrich_after_us <= now_us) {
+            id = entry.first;
+            ip = entry.second.info.ip;
+            found = true;
+            break;
+        }
+    }
+    xSemaphoreGive(mutex);
+    return found;
+}
+
+void DeviceRegistry::enrichment_failed(const std::string &id, int64_t now_us) {
+    static const int64_t FIRST_RETRY_US = 5 * 1000000LL;
+    static const int64_t MAX_RETRY_US = 5 * 60 * 1000000LL;
+
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    auto it = devices.find(id);
+    if (it != devices.end()) {
+        Entry &entry = it->second;
+        int64_t wait = FIRST_RETRY_US << std::min(entry.enrich_failures, 6);
+        entry.enrich_after_us = now_us + std::min(wait, MAX_RETRY_US);
+        entry.enrich_failures++;
+    }
+    xSemaphoreGive(mutex);
+}
+
+int64_t DeviceRegistry::next_enrichment_us() const {
+    int64_t next = INT64_MAX;
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    for (const auto &entry : devices) {
+        if (entry.second.info.serialNumber.empty()) next = std::min(next, entry.second.enrich_after_us);
+    }
+    xSemaphoreGive(mutex);
+    return next;
+}
+
+bool DeviceRegistry::has_address(const std::string &ip) const {
+    bool found = false;
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    for (const auto &entry : devices) {
+        if (entry.second.info.ip == ip) {
+            found = true;
+            break;
+        }
+    }
+    xSemaphoreGive(mutex);
+    return found;
+}
+
+std::vector<DeviceInfo> DeviceRegistry::all(uint32_t* generation) const {
+    std::vector<DeviceInfo> out;
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    out.reserve(devices.size());
+    for (const auto &entry : devices) {
+        out.push_back(entry.second.info);
+    }
+    if (generation) *generation = changes;
+    xSemaphoreGive(mutex);
+    return out;
+}
+
+uint32_t DeviceRegistry::generation() const {
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    uint32_t n = changes;
+    xSemaphoreGive(mutex);
+    return n;
+}
+
+size_t DeviceRegistry::size() const {
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    size_t n = devices.size();
+    xSemaphoreGive(mutex);
+    return n;
+}
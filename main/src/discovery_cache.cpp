@@ -0,0 +1,318 @@
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+
+#include "esp_log.h"
+#include "esp_random.h"
+
+#include "discovery_cache.h"
+#include "mdns_packet.h"
+
+static const char* TAG = "DISCOVERY_CACHE";
+
+// Events the consumer may fall behind by before the cache starts dropping
+// them (and flags an overflow instead)
+static const UBaseType_t EVENT_QUEUE_LENGTH = 16;
+
+// Refresh points as a percentage of the record TTL (RFC 6762 section 5.2)
+static const uint8_t REFRESH_PERCENT[] = {80, 85, 90, 95};
+static const uint8_t REFRESH_COUNT = sizeof(REFRESH_PERCENT) / sizeof(REFRESH_PERCENT[0]);
+
+DiscoveryCache::DiscoveryCache() {
+    mutex = xSemaphoreCreateMutex();
+    events = xQueueCreate(EVENT_QUEUE_LENGTH, sizeof(DiscoveryEvent));
+}
+
+// Never blocks: the mDNS task must not stall on a slow consumer.
+void DiscoveryCache::push_event(DiscoveryEvent::Type type, const std::string &ip) {
+    DiscoveryEvent event;
+    event.type = type;
+    snprintf(event.ip, sizeof(event.ip), "%s", ip.c_str());
+    if (xQueueSend(events, &event, 0) != pdTRUE) {
+        events_overflowed = true;
+    }
+}
+
+bool DiscoveryCache::wait_event(DiscoveryEvent &event, TickType_t timeout) {
+    return xQueueReceive(events, &event, timeout) == pdTRUE;
+}
+
+// True if an A record other than `except` resolves to `ip`. Caller holds the mutex.
+bool DiscoveryCache::address_shared_locked(const std::string &ip, const Key &except) const {
+    for (const auto &entry : records) {
+        if (entry.first.first == MDNS_TYPE_A && entry.first != except && entry.second.value == ip) return true;
+    }
+    return false;
+}
+
+// Caller holds the mutex.
+void DiscoveryCache::push_instance_changed_locked(const std::string &instance) {
+    auto srv = records.find(Key(MDNS_TYPE_SRV, instance));
+    if (srv == records.end()) return;
+    auto a = records.find(Key(MDNS_TYPE_A, srv->second.value));
+    if (a == records.end()) return;
+    push_event(DiscoveryEvent::DEVICE_CHANGED, a->second.value);
+}
+
+void DiscoveryCache::schedule_refresh(Record &rec) {
+    if (rec.refreshes_sent >= REFRESH_COUNT) {
+        rec.next_refresh_us = INT64_MAX;
+        return;
+    }
+    int64_t ttl_us = (int64_t)rec.ttl_s * 1000000;
+    int64_t jitter_us = ttl_us / 50 > 0 ? esp_random() % (ttl_us / 50) : 0; // 0-2% of TTL
+    rec.next_refresh_us = rec.received_us + ttl_us * REFRESH_PERCENT[rec.refreshes_sent] / 100 + jitter_us;
+}
+
+// Caller holds the mutex.
+void DiscoveryCache::erase_locked(const Key &key) {
+    auto it = records.find(key);
+    if (it == records.end()) return;
+
+    Record rec = std::move(it->second);
+    records.erase(it);
+    record_generation++;
+
+    if (key.first == MDNS_TYPE_A) {
+        // Only retire the address if no other hostname still resolves to it
+        if (!address_shared_locked(rec.value, key)) {
+            push_event(DiscoveryEvent::DEVICE_EXPIRED, rec.value);
+        }
+    } else if (key.first == MDNS_TYPE_PTR) {
+        // The instance is gone, take its description with it
+        erase_locked(Key(MDNS_TYPE_SRV, rec.value));
+        erase_locked(Key(MDNS_TYPE_TXT, rec.value));
+    } else if (key.first == MDNS_TYPE_SRV) {
+        // Drop the target's address unless another instance still uses it
+        for (const auto &entry : records) {
+            if (entry.first.first == MDNS_TYPE_SRV && entry.second.value == rec.value) return;
+        }
+        erase_locked(Key(MDNS_TYPE_A, rec.value));
+    }
+}
+
+// Caller holds the mutex.
+DiscoveryCache::Record* DiscoveryCache::upsert_locked(const Key &key, uint32_t ttl, int64_t now_us) {
+    if (ttl == 0) {
+        // Goodbye packet: the record is withdrawn now rather than after the
+        // one second grace period, so commands stop targeting it immediately
+        if (records.count(key)) {
+            ESP_LOGI(TAG, "Goodbye for %s", key.second.c_str());
+            erase_locked(key);
+        }
+        return nullptr;
+    }
+
+    auto inserted = records.emplace(key, Record());
+    if (inserted.second) record_generation++;
+
+    Record &rec = inserted.first->second;
+    rec.ttl_s = ttl;
+    rec.received_us = now_us;
+    rec.expires_us = now_us + (int64_t)ttl * 1000000;
+    rec.refreshes_sent = 0;
+    schedule_refresh(rec);
+    return &rec;
+}
+
+void DiscoveryCache::update(uint16_t type, const std::string &name, const std::string &value, uint32_t ttl, int64_t now_us) {
+    Key key(type, type == MDNS_TYPE_PTR ? value : name);
+    xSemaphoreTake(mutex, portMAX_DELAY);
+
+    auto it = records.find(key);
+    std::string old_value;
+    bool is_new = it == records.end() && ttl > 0;
+    bool moved = it != records.end() && ttl > 0 && type == MDNS_TYPE_A && it->second.value != value;
+    if (is_new) {
+        ESP_LOGI(TAG, "New %s record %s %s (ttl %lu s)", type == MDNS_TYPE_A ? "A" : "PTR",
+                 name.c_str(), value.c_str(), (unsigned long)ttl);
+    } else if (moved) {
+        ESP_LOGI(TAG, "%s moved from %s to %s", name.c_str(), it->second.value.c_str(), value.c_str());
+        record_generation++;
+        old_value = it->second.value;
+    }
+
+    Record* rec = upsert_locked(key, ttl, now_us);
+    if (rec) {
+        rec->name = name;
+        rec->value = value;
+    }
+
+    if (type == MDNS_TYPE_A && (is_new || moved)) {
+        push_event(is_new ? DiscoveryEvent::DEVICE_NEW : DiscoveryEvent::DEVICE_CHANGED, value);
+        // Retire the old address unless another hostname still uses it
+        if (moved && !address_shared_locked(old_value, key)) {
+            push_event(DiscoveryEvent::DEVICE_EXPIRED, old_value);
+        }
+    }
+
+    xSemaphoreGive(mutex);
+}
+
+void DiscoveryCache::update_srv(const std::string &instance, const std::string &target, uint16_t port, uint32_t ttl, int64_t now_us) {
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    Record* rec = upsert_locked(Key(MDNS_TYPE_SRV, instance), ttl, now_us);
+    if (rec && (rec->value != target || rec->port != port)) {
+        rec->name = instance;
+        rec->value = target;
+        rec->port = port;
+        push_instance_changed_locked(instance);
+    }
+    xSemaphoreGive(mutex);
+}
+
+void DiscoveryCache::update_txt(const std::string &instance, const std::vector<std::string> &entries, uint32_t ttl, int64_t now_us) {
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    Record* rec = upsert_locked(Key(MDNS_TYPE_TXT, instance), ttl, now_us);
+    if (rec && (rec->name != instance || rec->txt != entries)) {
+        rec->name = instance;
+        rec->txt = entries;
+        push_instance_changed_locked(instance);
+    }
+    xSemaphoreGive(mutex);
+}
+
+bool DiscoveryCache::contains(uint16_t type, const std::string &key) const {
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    bool found = records.find(Key(type, key)) != records.end();
+    xSemaphoreGive(mutex);
+    return found;
+}
+
+void DiscoveryCache::expire(int64_t now_us) {
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    for (auto it = records.begin(); it != records.end();) {
+        if (it->second.expires_us <= now_us) {
+            ESP_LOGI(TAG, "Expired %s", it->first.second.c_str());
+            // Erasing may cascade to other records, so restart the scan
+            erase_locked(Key(it->first));
+            it = records.begin();
+        } else {
+            ++it;
+        }
+    }
+    xSemaphoreGive(mutex);
+}
+
+void DiscoveryCache::take_due_refreshes(int64_t now_us, std::vector<RefreshQuery> &out) {
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    bool ptr_queued = false;
+    for (auto &entry : records) {
+        Record &rec = entry.second;
+        if (rec.next_refresh_us > now_us) continue;
+
+        rec.refreshes_sent++;
+        schedule_refresh(rec);
+
+        if (entry.first.first == MDNS_TYPE_PTR) {
+            // All PTR records share the service name; one query refreshes them all
+            if (ptr_queued) continue;
+            ptr_queued = true;
+        }
+        out.push_back({rec.name, entry.first.first});
+    }
+    xSemaphoreGive(mutex);
+}
+
+int64_t DiscoveryCache::next_deadline() const {
+    int64_t deadline = INT64_MAX;
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    for (const auto &entry : records) {
+        deadline = std::min(deadline, std::min(entry.second.expires_us, entry.second.next_refresh_us));
+    }
+    xSemaphoreGive(mutex);
+    return deadline;
+}
+
+void DiscoveryCache::known_answers(int64_t now_us, std::vector<KnownAnswer> &out) const {
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    for (const auto &entry : records) {
+        if (entry.first.first != MDNS_TYPE_PTR) continue;
+        const Record &rec = entry.second;
+        int64_t remaining_us = rec.expires_us - now_us;
+        if (remaining_us * 2 > (int64_t)rec.ttl_s * 1000000) {
+            out.push_back({rec.value, (uint32_t)(remaining_us / 1000000)});
+        }
+    }
+    xSemaphoreGive(mutex);
+}
+
+std::set<std::string> DiscoveryCache::live_ips() const {
+    std::set<std::string> ips;
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    for (const auto &entry : records) {
+        if (entry.first.first == MDNS_TYPE_A) {
+            ips.insert(entry.second.value);
+        }
+    }
+    xSemaphoreGive(mutex);
+    return ips;
+}
+
+// Return the value of `key` in a TXT record's "key=value" entries
+static std::string txt_value(const std::vector<std::string> &txt, const char* key) {
+    size_t key_len = strlen(key);
+    for (const auto &entry : txt) {
+        if (entry.size() > key_len && entry[key_len] == '=' && entry.compare(0, key_len, key) == 0) {
+            return entry.substr(key_len + 1);
+        }
+    }
+    return "";
+}
+
+// Assemble the device for an SRV record. Caller holds the mutex.
+bool DiscoveryCache::device_from_srv_locked(const Record &srv, DiscoveredDevice &device) const {
+    auto a = records.find(Key(MDNS_TYPE_A, srv.value));
+    if (a == records.end()) return false;
+
+    device.instance = srv.name;
+    device.hostname = srv.value;
+    device.ip = a->second.value;
+    device.port = srv.port;
+
+    auto txt = records.find(Key(MDNS_TYPE_TXT, srv.name));
+    if (txt != records.end()) {
+        device.mac = txt_value(txt->second.txt, "id");
+        device.model = txt_value(txt->second.txt, "md");
+    }
+    return true;
+}
+
+std::map<std::string, DiscoveredDevice> DiscoveryCache::live_devices() const {
+    std::map<std::string, DiscoveredDevice> devices;
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    for (const auto &entry : records) {
+        if (entry.first.first != MDNS_TYPE_SRV) continue;
+
+        DiscoveredDevice device;
+        if (device_from_srv_locked(entry.second, device)) {
+            devices[device.ip] = device;
+        }
+    }
+    xSemaphoreGive(mutex);
+    return devices;
+}
+
+std::optional<DiscoveredDevice> DiscoveryCache::live_device(const std::string &ip) const {
+    std::optional<DiscoveredDevice> found;
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    for (const auto &entry : records) {
+        if (entry.first.first != MDNS_TYPE_SRV) continue;
+
+        DiscoveredDevice device;
+        if (device_from_srv_locked(entry.second, device) && device.ip == ip) {
+            found = device;
+            break;
+        }
+    }
+    xSemaphoreGive(mutex);
+    return found;
+}
+
+size_t DiscoveryCache::size() const {
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    size_t n = records.size();
+    xSemaphoreGive(mutex);
+    return n;
+}
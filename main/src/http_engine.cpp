@@ -0,0 +1,1111 @@
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/select.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <strings.h>
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_vfs_eventfd.h"
+
+#include "http_engine.h"
+
+static const char* TAG = "HTTP_ENGINE";
+
+// Longest status line and headers accepted before the body
+static const size_t MAX_RESPONSE_HEADERS = 1024;
+
+// Idle keep-alive connections are closed after this long
+static const int64_t IDLE_TIMEOUT_US = 20 * 1000000;
+
+// A light's precomputed state and health are dropped once nothing has been
+// submitted for it for this long
+static const int64_t FORGET_AFTER_US = 10 * 60 * 1000000LL;
+
+// Adaptive timeouts (RFC 6298): before the first sample, the bounds, and the
+// most a timeout is doubled after consecutive timeouts. The floor is below
+// RFC 6298's 1 s because an attempt that times out is retried on a fresh
+// connection until the request's deadline rather than failed, which gets
+// past a lost segment sooner than lwIP's own retransmission would.
+static const int64_t INITIAL_RTO_US = 1000 * 1000;
+static const int64_t MIN_RTO_US = 200 * 1000;
+static const int64_t MAX_RTO_US = (int64_t)HTTP_ENGINE_MAX_TIMEOUT_MS * 1000;
+static const int MAX_RTO_BACKOFF = 3;
+
+// Circuit breaker: open after this many failures in a row, then probe with
+// exponential backoff between these intervals
+static const int BREAKER_THRESHOLD = 3;
+static const int64_t PROBE_MIN_INTERVAL_US = 1000 * 1000;
+static const int64_t PROBE_MAX_INTERVAL_US = 60 * 1000 * 1000;
+
+// Hedging: round trips kept per light for its 95th percentile, how many are
+// needed before hedging it, and the shortest wait before a duplicate
+static const size_t RTT_WINDOW = 20;
+static const size_t MIN_HEDGE_SAMPLES = 10;
+static const int64_t MIN_HEDGE_DELAY_US = 10 * 1000;
+
+// Hedge budget: every hedgeable request earns HTTP_ENGINE_HEDGE_BUDGET_PERCENT
+// credits, a hedge costs HEDGE_COST, and a burst of HEDGE_BURST hedges can
+// be saved up
+static const int HEDGE_COST = 100;
+static const int HEDGE_BURST = 3 * HEDGE_COST;
+
+namespace {
+
+enum class ConnState : uint8_t {
+    CLOSED,
+    CONNECTING,  // Non-blocking connect() in progress
+    SENDING,     // Writing the request
+    RECEIVING,   // Reading the response
+    IDLE,        // Kept alive, no request in flight
+};
+
+struct PendingRequest {
+    HttpEngineMethod method;
+    std::string path;
+    std::string body;
+    HttpEngineCallback callback;
+    HttpEngineBodySink sink;     // Receives the body as it arrives; null to collect it
+    int64_t submitted_us;
+    int64_t deadline_us;         // Overall deadline, including waiting for a socket
+    int64_t attempt_deadline_us = 0; // Deadline once on the wire
+    bool adaptive = false;       // Attempt deadline comes from the light's RTO
+    bool probe = false;          // Circuit breaker probe; no callback
+    bool hedge = false;          // Idempotent: may be duplicated on a second connection
+    bool retried = false;
+};
+
+// Round-trip statistics and circuit breaker state for one light
+struct HostHealth {
+    int64_t srtt_us = 0;
+    int64_t rttvar_us = 0;
+    uint32_t samples = 0;
+    int backoff = 0;             // RTO doublings after timeouts
+    int consecutive_failures = 0;
+    uint32_t successes = 0;
+    uint32_t failures = 0;
+    uint32_t rejected = 0;
+    bool open = false;
+    bool probing = false;
+    int64_t probe_interval_us = 0;
+    int64_t next_probe_us = 0;
+    int64_t recent_rtt_us[RTT_WINDOW];  // Ring of the latest round trips
+    size_t recent_count = 0;
+    size_t recent_next = 0;
+    int64_t p95_us = 0;          // 0 until MIN_HEDGE_SAMPLES round trips are known
+    uint32_t hedges = 0;
+    uint32_t hedge_wins = 0;
+};
+
+enum class ChunkState : uint8_t {
+    SIZE,       // Reading a chunk-size line
+    DATA,       // Reading chunk data
+    DATA_END,   // Reading the CRLF after chunk data
+    TRAILER,    // After the last chunk, reading trailers up to the blank line
+};
+
+// Progress of the response to the request in flight
+struct ResponseState {
+    size_t received = 0;          // Bytes read from the socket so far
+    bool headers_done = false;
+    int status = 0;
+    long content_length = -1;
+    bool chunked = false;
+    bool close = false;           // "Connection: close", or no length (read to EOF)
+    size_t body_len = 0;          // Decoded body bytes delivered so far
+    bool complete = false;
+    ChunkState chunk_state = ChunkState::SIZE;
+    size_t chunk_remaining = 0;
+    char line[24];                // Chunk-size or trailer line being read
+    size_t line_len = 0;
+};
+
+// Duplicate of the request in flight on a second connection, sent when the
+// light takes longer than usual to answer. It lives only until either
+// connection receives the first byte of a response: a duplicate that
+// answers first takes over as the light's connection.
+struct Hedge {
+    int fd = -1;
+    ConnState state = ConnState::CLOSED;  // CONNECTING, SENDING or RECEIVING
+    size_t tx_sent = 0;          // Bytes of the in-flight request's tx sent
+    int64_t sent_us = 0;
+};
+
+// One light: its address, precomputed requests, socket and request queue.
+// The front of `queue` is the request in flight while the connection is
+// CONNECTING, SENDING or RECEIVING.
+struct Connection {
+    struct sockaddr_in addr;
+    std::string host;            // "ip:port", for the Host header
+    std::string lights_get;      // Complete "GET /elgato/lights" request
+    std::string lights_put;      // "PUT /elgato/lights" preamble, up to the Content-Length value
+    int fd = -1;
+    ConnState state = ConnState::CLOSED;
+    bool reused = false;         // The request in flight went out on a kept-alive connection
+    std::deque<PendingRequest> queue;
+    std::string tx;
+    size_t tx_sent = 0;
+    std::string rx;              // Response headers, until they are complete
+    std::string body;            // Response body, for requests without a sink
+    ResponseState response;
+    int64_t sent_us = 0;         // When the request in flight started going out on an open connection
+    int64_t hedge_at_us = 0;     // When to hedge the request in flight, or 0
+    Hedge hedge;
+    int64_t last_used_us = 0;
+    int64_t last_submitted_us = 0;
+    HostHealth health;
+};
+
+struct Submission {
+    std::string ip;
+    uint16_t port;
+    PendingRequest request;
+};
+
+} // namespace
+
+// Requests handed over by other tasks, guarded by s_inbox_mutex; the engine
+// task is woken through s_wake_fd
+static std::deque<Submission> s_inbox;
+static SemaphoreHandle_t s_inbox_mutex = nullptr;
+static int s_wake_fd = -1;
+
+// Owned by the engine task
+static std::map<std::string, Connection> s_connections;
+static int s_open_connections = 0;
+static int s_hedge_credits = HEDGE_BURST;
+
+static std::atomic<bool> s_hedging{false};
+
+// Copy of every light's health for http_engine_stats(), guarded by s_stats_mutex
+static std::map<std::string, HttpEngineHostStats> s_stats;
+static SemaphoreHandle_t s_stats_mutex = nullptr;
+
+static const char* method_name(HttpEngineMethod method) {
+    return method == HttpEngineMethod::PUT ? "PUT" : "GET";
+}
+
+static void init_connection(Connection &conn, const std::string &ip, uint16_t port) {
+    memset(&conn.addr, 0, sizeof(conn.addr));
+    conn.addr.sin_family = AF_INET;
+    conn.addr.sin_port = htons(port);
+    inet_pton(AF_INET, ip.c_str(), &conn.addr.sin_addr);
+
+    conn.host = ip + ":" + std::to_string(port);
+    conn.lights_get = "GET /elgato/lights HTTP/1.1\r\nHost: " + conn.host +
+                      "\r\nConnection: keep-alive\r\n\r\n";
+    conn.lights_put = "PUT /elgato/lights HTTP/1.1\r\nHost: " + conn.host +
+                      "\r\nConnection: keep-alive\r\nContent-Type: application/json\r\nContent-Length: ";
+}
+
+// Serialize the front request into conn.tx, using the precomputed
+// preambles for /elgato/lights.
+static void build_request(Connection &conn) {
+    const PendingRequest &req = conn.queue.front();
+    conn.tx.clear();
+    conn.tx_sent = 0;
+
+    if (req.path == "/elgato/lights" && req.method == HttpEngineMethod::GET) {
+        conn.tx = conn.lights_get;
+        return;
+    }
+    if (req.path == "/elgato/lights" && req.method == HttpEngineMethod::PUT) {
+        conn.tx = conn.lights_put;
+    } else {
+        conn.tx.append(method_name(req.method)).append(" ").append(req.path);
+        conn.tx.append(" HTTP/1.1\r\nHost: ").append(conn.host).append("\r\nConnection: keep-alive\r\n");
+        if (req.body.empty()) {
+            conn.tx.append("\r\n");
+            return;
+        }
+        conn.tx.append("Content-Type: application/json\r\nContent-Length: ");
+    }
+    conn.tx.append(std::to_string(req.body.size())).append("\r\n\r\n").append(req.body);
+}
+
+static void close_connection(Connection &conn) {
+    if (conn.fd >= 0) {
+        close(conn.fd);
+        conn.fd = -1;
+        s_open_connections--;
+    }
+    conn.state = ConnState::CLOSED;
+    conn.rx.clear();
+    conn.body.clear();
+    conn.response = ResponseState();
+}
+
+static void close_hedge(Connection &conn) {
+    if (conn.hedge.fd >= 0) {
+        close(conn.hedge.fd);
+        s_open_connections--;
+    }
+    conn.hedge = Hedge();
+}
+
+// Current retransmission timeout for the light: SRTT + 4 * RTTVAR, doubled
+// per consecutive timeout.
+static int64_t rto_us(const HostHealth &health) {
+    int64_t rto = health.samples ? health.srtt_us + 4 * health.rttvar_us : INITIAL_RTO_US;
+    rto = std::max(rto, MIN_RTO_US) << health.backoff;
+    return std::min(rto, MAX_RTO_US);
+}
+
+static void publish_stats(const std::string &key, const Connection &conn) {
+    const HostHealth &health = conn.health;
+    HttpEngineHostStats stats;
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &conn.addr.sin_addr, ip, sizeof(ip));
+    stats.ip = ip;
+    stats.port = ntohs(conn.addr.sin_port);
+    stats.srtt_ms = health.srtt_us / 1000;
+    stats.rttvar_ms = health.rttvar_us / 1000;
+    stats.timeout_ms = rto_us(health) / 1000;
+    stats.samples = health.samples;
+    stats.successes = health.successes;
+    stats.failures = health.failures;
+    stats.rejected = health.rejected;
+    stats.consecutive_failures = health.consecutive_failures;
+    stats.circuit_open = health.open;
+    stats.next_probe_us = health.open ? health.next_probe_us : 0;
+    stats.p95_ms = health.p95_us / 1000;
+    stats.hedges = health.hedges;
+    stats.hedge_wins = health.hedge_wins;
+
+    xSemaphoreTake(s_stats_mutex, portMAX_DELAY);
+    s_stats[key] = stats;
+    xSemaphoreGive(s_stats_mutex);
+}
+
+static void respond(Connection &conn, PendingRequest &req, HttpEngineResponse &response) {
+    conn.last_used_us = esp_timer_get_time();
+    ESP_LOGD(TAG, "%s %s%s -> %d in %lld ms", method_name(req.method), conn.host.c_str(), req.path.c_str(),
+             response.status, (conn.last_used_us - req.submitted_us) / 1000);
+    if (req.callback) req.callback(response);
+}
+
+static void respond_error(Connection &conn, PendingRequest &req, const std::string &error) {
+    HttpEngineResponse response;
+    response.error = error + " (" + conn.host + ")";
+    respond(conn, req, response);
+}
+
+// The light answered: take an RTT sample (Karn's rule: not for retried
+// requests) and close the circuit breaker.
+static void note_success(Connection &conn, const PendingRequest &req) {
+    HostHealth &health = conn.health;
+    if (!req.retried && conn.sent_us > 0) {
+        int64_t rtt = esp_timer_get_time() - conn.sent_us;
+        if (health.samples == 0) {
+            health.srtt_us = rtt;
+            health.rttvar_us = rtt / 2;
+        } else {
+            health.rttvar_us += (std::llabs(health.srtt_us - rtt) - health.rttvar_us) / 4;
+            health.srtt_us += (rtt - health.srtt_us) / 8;
+        }
+        health.samples++;
+
+        health.recent_rtt_us[health.recent_next] = rtt;
+        health.recent_next = (health.recent_next + 1) % RTT_WINDOW;
+        health.recent_count = std::min(health.recent_count + 1, RTT_WINDOW);
+        if (health.recent_count >= MIN_HEDGE_SAMPLES) {
+            int64_t sorted[RTT_WINDOW];
+            std::copy(health.recent_rtt_us, health.recent_rtt_us + health.recent_count, sorted);
+            std::sort(sorted, sorted + health.recent_count);
+            health.p95_us = sorted[(health.recent_count * 95 + 99) / 100 - 1];
+        }
+    }
+    health.backoff = 0;
+    health.consecutive_failures = 0;
+    health.successes++;
+    if (health.open) {
+        ESP_LOGI(TAG, "%s is reachable again", conn.host.c_str());
+        health.open = false;
+        health.probing = false;
+    }
+    publish_stats(conn.host, conn);
+}
+
+// Fail every queued request at once while the breaker is open.
+static void reject_queued(Connection &conn) {
+    while (!conn.queue.empty()) {
+        PendingRequest req = std::move(conn.queue.front());
+        conn.queue.pop_front();
+        conn.health.rejected++;
+        respond_error(conn, req, "Light unreachable");
+    }
+}
+
+// The light failed to answer: count it, and open the breaker (or push the
+// next probe out) as needed.
+static void note_failure(Connection &conn, const PendingRequest &req, bool timed_out) {
+    HostHealth &health = conn.health;
+    int64_t now = esp_timer_get_time();
+    health.failures++;
+    health.consecutive_failures++;
+    if (timed_out) health.backoff = std::min(health.backoff + 1, MAX_RTO_BACKOFF);
+
+    if (req.probe) {
+        health.probing = false;
+        health.probe_interval_us = std::min(health.probe_interval_us * 2, PROBE_MAX_INTERVAL_US);
+        health.next_probe_us = now + health.probe_interval_us;
+    } else if (!health.open && health.consecutive_failures >= BREAKER_THRESHOLD) {
+        ESP_LOGW(TAG, "%s failed %d times in a row, failing fast until it answers a probe",
+                 conn.host.c_str(), health.consecutive_failures);
+        health.open = true;
+        health.probe_interval_us = PROBE_MIN_INTERVAL_US;
+        health.next_probe_us = now + health.probe_interval_us;
+    }
+    publish_stats(conn.host, conn);
+}
+
+// Pop the front request and hand its outcome to the callback.
+static void finish_request(Connection &conn, HttpEngineResponse &response) {
+    close_hedge(conn);
+    conn.hedge_at_us = 0;
+    PendingRequest req = std::move(conn.queue.front());
+    conn.queue.pop_front();
+    note_success(conn, req);
+    respond(conn, req, response);
+}
+
+// Pop the front request and fail it. `host_failure` marks failures that say
+// the light is not answering (as opposed to a bad response or no socket),
+// which count towards the circuit breaker.
+static void fail_request(Connection &conn, const std::string &error, bool host_failure = false,
+                         bool timed_out = false) {
+    close_hedge(conn);
+    conn.hedge_at_us = 0;
+    PendingRequest req = std::move(conn.queue.front());
+    conn.queue.pop_front();
+    if (host_failure) note_failure(conn, req, timed_out);
+    respond_error(conn, req, error);
+    if (conn.health.open && !conn.health.probing) reject_queued(conn);
+}
+
+// The connection broke while a request was in flight. A kept-alive
+// connection that the light closed before answering is retried once on a
+// fresh connection; anything else fails the request.
+//
+// The retry reconnects right away rather than leaving the connection CLOSED
+// for start_requests(): the first send on a kept-alive connection happens
+// inside start_requests(), so a light that has already reset it fails us
+// there, and nothing would come back to restart the request before its
+// deadline. The new connection is not reused, so this recurses at most once.
+static bool start_request(Connection &conn);
+
+static void connection_failed(Connection &conn, const char* error) {
+    bool retry = conn.reused && conn.response.received == 0 && !conn.queue.front().retried;
+    close_connection(conn);
+    close_hedge(conn);
+    if (retry) {
+        ESP_LOGD(TAG, "Connection to %s was closed, reconnecting", conn.host.c_str());
+        conn.queue.front().retried = true;
+        start_request(conn); // Out of sockets: start_requests() picks it up once one is free
+        return;
+    }
+    fail_request(conn, error, true);
+}
+
+// Close the least recently used idle connection with nothing queued, to free
+// its socket for another light. Returns false if there is none.
+static bool evict_idle_connection() {
+    Connection* lru = nullptr;
+    for (auto &entry : s_connections) {
+        Connection &conn = entry.second;
+        if (conn.state == ConnState::IDLE && conn.queue.empty() &&
+            (!lru || conn.last_used_us < lru->last_used_us)) {
+            lru = &conn;
+        }
+    }
+    if (!lru) return false;
+    ESP_LOGD(TAG, "Evicting idle connection to %s", lru->host.c_str());
+    close_connection(*lru);
+    return true;
+}
+
+static void try_send(Connection &conn) {
+    while (conn.tx_sent < conn.tx.size()) {
+        ssize_t n = send(conn.fd, conn.tx.data() + conn.tx_sent, conn.tx.size() - conn.tx_sent, MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            connection_failed(conn, "Send failed");
+            return;
+        }
+        conn.tx_sent += n;
+    }
+    conn.state = ConnState::RECEIVING;
+}
+
+// Start the front request: on the open connection if there is one,
+// otherwise by connecting. Returns false if no socket is available yet.
+static bool start_request(Connection &conn) {
+    build_request(conn);
+    conn.rx.clear();
+    conn.body.clear();
+    conn.response = ResponseState();
+
+    // An adaptive request gets one RTO once on the wire, two if it has to
+    // connect first
+    int64_t now = esp_timer_get_time();
+    PendingRequest &req = conn.queue.front();
+    int64_t budget = req.adaptive ? rto_us(conn.health) : req.deadline_us - now;
+    if (req.adaptive && conn.state != ConnState::IDLE) budget *= 2;
+    req.attempt_deadline_us = std::min(now + budget, req.deadline_us);
+
+    // Hedge an idempotent request once it has taken longer than 95% of the
+    // light's recent answers (plus the same again for connecting)
+    conn.hedge_at_us = 0;
+    if (req.hedge && s_hedging && conn.health.p95_us > 0) {
+        int64_t delay = std::max(conn.health.p95_us, MIN_HEDGE_DELAY_US);
+        if (conn.state != ConnState::IDLE) delay *= 2;
+        conn.hedge_at_us = now + delay;
+        s_hedge_credits = std::min(s_hedge_credits + HTTP_ENGINE_HEDGE_BUDGET_PERCENT, HEDGE_BURST);
+    }
+
+    if (conn.state == ConnState::IDLE) {
+        conn.reused = true;
+        conn.state = ConnState::SENDING;
+        conn.sent_us = now;
+        try_send(conn);
+        return true;
+    }
+
+    if (s_open_connections >= HTTP_ENGINE_MAX_CONNECTIONS && !evict_idle_connection()) {
+        return false;
+    }
+
+    conn.reused = false;
+    conn.fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (conn.fd < 0) {
+        fail_request(conn, "Failed to create socket");
+        return true;
+    }
+    s_open_connections++;
+
+    int flags = fcntl(conn.fd, F_GETFL, 0);
+    fcntl(conn.fd, F_SETFL, flags | O_NONBLOCK);
+    int nodelay = 1;
+    setsockopt(conn.fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    conn.sent_us = 0;
+    if (connect(conn.fd, (struct sockaddr*)&conn.addr, sizeof(conn.addr)) == 0) {
+        conn.state = ConnState::SENDING;
+        conn.sent_us = esp_timer_get_time();
+        try_send(conn);
+    } else if (errno == EINPROGRESS) {
+        conn.state = ConnState::CONNECTING;
+    } else {
+        close_connection(conn);
+        fail_request(conn, "Failed to connect", true);
+    }
+    return true;
+}
+
+static void start_requests() {
+    for (auto &entry : s_connections) {
+        Connection &conn = entry.second;
+        if (conn.queue.empty()) continue;
+        if (conn.state != ConnState::CLOSED && conn.state != ConnState::IDLE) continue;
+        if (!start_request(conn)) return; // Out of sockets; the rest wait
+    }
+}
+
+static bool header_equals(const char* line, size_t len, const char* name, size_t &value_at) {
+    size_t name_len = strlen(name);
+    if (len <= name_len || strncasecmp(line, name, name_len) != 0 || line[name_len] != ':') return false;
+    value_at = name_len + 1;
+    while (value_at < len && line[value_at] == ' ') value_at++;
+    return true;
+}
+
+// Parse the status line and the headers we care about, once conn.rx holds
+// them up to and including the blank line. Returns false if the response
+// is malformed.
+static bool parse_headers(Connection &conn, size_t header_len) {
+    ResponseState &res = conn.response;
+    const char* p = conn.rx.data();
+    res.headers_done = true;
+
+    if (header_len < 12 || strncmp(p, "HTTP/1.", 7) != 0) return false;
+    res.status = atoi(p + 9);
+    res.close = strncmp(p, "HTTP/1.0", 8) == 0;
+
+    size_t line = conn.rx.find("\r\n") + 2;
+    while (line < header_len - 2) {
+        size_t end = conn.rx.find("\r\n", line);
+        const char* text = p + line;
+        size_t len = end - line;
+        size_t value_at;
+        if (header_equals(text, len, "Content-Length", value_at)) {
+            res.content_length = strtol(text + value_at, nullptr, 10);
+        } else if (header_equals(text, len, "Transfer-Encoding", value_at)) {
+            res.chunked = strncasecmp(text + value_at, "chunked", 7) == 0;
+        } else if (header_equals(text, len, "Connection", value_at)) {
+            if (strncasecmp(text + value_at, "close", 5) == 0) res.close = true;
+            if (strncasecmp(text + value_at, "keep-alive", 10) == 0) res.close = false;
+        }
+        line = end + 2;
+    }
+    if (!res.chunked && res.content_length < 0) res.close = true; // Body runs to EOF
+    if (!res.chunked && res.content_length == 0) res.complete = true;
+    return res.status > 0;
+}
+
+// Hand decoded body bytes to the request's sink, or collect them. Returns
+// false if the body exceeds HTTP_ENGINE_MAX_RESPONSE_BODY.
+static bool deliver_body(Connection &conn, const char* data, size_t len) {
+    if (len == 0) return true;
+    conn.response.body_len += len;
+    if (conn.response.body_len > HTTP_ENGINE_MAX_RESPONSE_BODY) return false;
+
+    const PendingRequest &req = conn.queue.front();
+    if (req.sink) {
+        req.sink(data, len);
+    } else {
+        conn.body.append(data, len);
+    }
+    return true;
+}
+
+// Read one line of chunked framing into res.line. Returns true once the
+// line is complete, with the CR stripped. Only the start of a long line is
+// kept: chunk extensions and trailers are not needed.
+static bool read_chunk_line(ResponseState &res, char c) {
+    if (c == '\n') {
+        if (res.line_len > 0 && res.line[res.line_len - 1] == '\r') res.line_len--;
+        res.line[res.line_len] = '\0';
+        return true;
+    }
+    if (res.line_len + 1 < sizeof(res.line)) res.line[res.line_len++] = c;
+    return false;
+}
+
+// Decode body bytes as they arrive. Returns an error message, or nullptr.
+static const char* process_body(Connection &conn, const char* data, size_t len) {
+    ResponseState &res = conn.response;
+
+    if (!res.chunked) {
+        if (res.content_length >= 0) {
+            size_t remaining = (size_t)res.content_length - res.body_len;
+            if (len > remaining) len = remaining; // Anything more is not ours
+        }
+        if (!deliver_body(conn, data, len)) return "Response too large";
+        if (res.content_length >= 0 && res.body_len == (size_t)res.content_length) res.complete = true;
+        return nullptr;
+    }
+
+    size_t i = 0;
+    while (i < len && !res.complete) {
+        switch (res.chunk_state) {
+        case ChunkState::SIZE:
+            if (read_chunk_line(res, data[i++])) {
+                char* end = nullptr;
+                unsigned long size = strtoul(res.line, &end, 16);
+                if (end == res.line) return "Malformed chunk";
+                res.line_len = 0;
+                res.chunk_remaining = size;
+                res.chunk_state = size == 0 ? ChunkState::TRAILER : ChunkState::DATA;
+            }
+            break;
+        case ChunkState::DATA: {
+            size_t n = std::min(res.chunk_remaining, len - i);
+            if (!deliver_body(conn, data + i, n)) return "Response too large";
+            i += n;
+            res.chunk_remaining -= n;
+            if (res.chunk_remaining == 0) res.chunk_state = ChunkState::DATA_END;
+            break;
+        }
+        case ChunkState::DATA_END:
+            if (data[i++] == '\n') res.chunk_state = ChunkState::SIZE;
+            break;
+        case ChunkState::TRAILER:
+            if (read_chunk_line(res, data[i++])) {
+                if (res.line_len == 0) res.complete = true; // The blank line
+                res.line_len = 0;
+            }
+            break;
+        }
+    }
+    return nullptr;
+}
+
+// Hand the finished response to the request in flight. `eof` is set when
+// the light closed the connection.
+static void complete_response(Connection &conn, bool eof) {
+    HttpEngineResponse response;
+    response.status = conn.response.status;
+    response.body = std::move(conn.body);
+
+    if (conn.response.close || eof) {
+        close_connection(conn);
+    } else {
+        conn.state = ConnState::IDLE;
+        conn.body.clear();
+        conn.response = ResponseState();
+    }
+    finish_request(conn, response);
+}
+
+// Feed newly received bytes through the header parser and body decoder,
+// and complete the request in flight once its response is whole.
+static void process_received(Connection &conn, const char* data, size_t len) {
+    ResponseState &res = conn.response;
+    if (res.received == 0) close_hedge(conn); // The original answered first
+    res.received += len;
+
+    if (!res.headers_done) {
+        size_t searched = conn.rx.size() >= 3 ? conn.rx.size() - 3 : 0;
+        conn.rx.append(data, len);
+        size_t end = conn.rx.find("\r\n\r\n", searched);
+        if (end == std::string::npos) {
+            if (conn.rx.size() > MAX_RESPONSE_HEADERS) {
+                close_connection(conn);
+                fail_request(conn, "Response headers too large");
+            }
+            return;
+        }
+        size_t header_len = end + 4;
+        if (!parse_headers(conn, header_len)) {
+            close_connection(conn);
+            fail_request(conn, "Malformed response");
+            return;
+        }
+        if (res.content_length > (long)HTTP_ENGINE_MAX_RESPONSE_BODY) {
+            close_connection(conn);
+            fail_request(conn, "Response too large");
+            return;
+        }
+        // Whatever followed the headers is the start of the body
+        data = conn.rx.data() + header_len;
+        len = conn.rx.size() - header_len;
+    }
+
+    const char* error = process_body(conn, data, len);
+    conn.rx.clear();
+    if (error) {
+        close_connection(conn);
+        fail_request(conn, error);
+        return;
+    }
+    if (res.complete) complete_response(conn, false);
+}
+
+static void handle_readable(Connection &conn) {
+    char buf[512];
+    while (true) {
+        ssize_t n = recv(conn.fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (n > 0) {
+            if (conn.state != ConnState::RECEIVING) {
+                close_connection(conn); // Unsolicited data on an idle connection
+                return;
+            }
+            process_received(conn, buf, n);
+            if (conn.state != ConnState::RECEIVING) return; // Done, or failed
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+
+        // EOF or reset
+        ResponseState &res = conn.response;
+        if (conn.state == ConnState::IDLE) {
+            close_connection(conn); // The light dropped a kept-alive connection
+        } else if (res.received == 0) {
+            connection_failed(conn, n == 0 ? "Connection closed" : "Connection reset");
+        } else if (res.headers_done && !res.chunked && res.content_length < 0) {
+            complete_response(conn, true); // The body ran to EOF
+        } else {
+            close_connection(conn);
+            fail_request(conn, res.headers_done ? "Truncated response" : "Connection closed before response", true);
+        }
+        return;
+    }
+}
+
+static void handle_writable(Connection &conn) {
+    if (conn.state == ConnState::CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(conn.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0) {
+            close_connection(conn);
+            fail_request(conn, std::string("Failed to connect: ") + strerror(err), true);
+            return;
+        }
+        conn.state = ConnState::SENDING;
+        conn.sent_us = esp_timer_get_time();
+    }
+    try_send(conn);
+}
+
+// Send the duplicate request on the hedge connection. A failure just drops
+// the hedge: the original is still in flight.
+static void hedge_send(Connection &conn) {
+    Hedge &hedge = conn.hedge;
+    while (hedge.tx_sent < conn.tx.size()) {
+        ssize_t n = send(hedge.fd, conn.tx.data() + hedge.tx_sent, conn.tx.size() - hedge.tx_sent, MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) close_hedge(conn);
+            return;
+        }
+        hedge.tx_sent += n;
+    }
+    hedge.state = ConnState::RECEIVING;
+}
+
+// Open a second connection to the light and send the request in flight on
+// it again, if the hedge budget and a socket allow.
+static void launch_hedge(Connection &conn) {
+    if (s_hedge_credits < HEDGE_COST) {
+        ESP_LOGD(TAG, "Hedge budget spent, not hedging %s", conn.host.c_str());
+        return;
+    }
+    if (s_open_connections >= HTTP_ENGINE_MAX_CONNECTIONS && !evict_idle_connection()) return;
+
+    Hedge &hedge = conn.hedge;
+    hedge.fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (hedge.fd < 0) return;
+    s_open_connections++;
+
+    int flags = fcntl(hedge.fd, F_GETFL, 0);
+    fcntl(hedge.fd, F_SETFL, flags | O_NONBLOCK);
+    int nodelay = 1;
+    setsockopt(hedge.fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    if (connect(hedge.fd, (struct sockaddr*)&conn.addr, sizeof(conn.addr)) == 0) {
+        hedge.state = ConnState::SENDING;
+        hedge.sent_us = esp_timer_get_time();
+    } else if (errno == EINPROGRESS) {
+        hedge.state = ConnState::CONNECTING;
+    } else {
+        close_hedge(conn);
+        return;
+    }
+
+    s_hedge_credits -= HEDGE_COST;
+    conn.health.hedges++;
+    ESP_LOGD(TAG, "Hedging %s %s%s", method_name(conn.queue.front().method), conn.host.c_str(),
+             conn.queue.front().path.c_str());
+    if (hedge.state == ConnState::SENDING) hedge_send(conn);
+}
+
+static void handle_hedge_writable(Connection &conn) {
+    Hedge &hedge = conn.hedge;
+    if (hedge.state == ConnState::CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(hedge.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0) {
+            close_hedge(conn);
+            return;
+        }
+        hedge.state = ConnState::SENDING;
+        hedge.sent_us = esp_timer_get_time();
+    }
+    hedge_send(conn);
+}
+
+// The hedge connection has something to read. If it is a response, the
+// duplicate beat the original: the original's connection is dropped and the
+// hedge carries on as the light's connection.
+static void handle_hedge_readable(Connection &conn) {
+    char buf[512];
+    ssize_t n = recv(conn.hedge.fd, buf, sizeof(buf), MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+    if (n <= 0) {
+        close_hedge(conn);
+        return;
+    }
+
+    ESP_LOGD(TAG, "Hedge to %s answered first", conn.host.c_str());
+    close_connection(conn);
+    conn.fd = conn.hedge.fd;
+    conn.state = ConnState::RECEIVING;
+    conn.reused = false;
+    conn.sent_us = conn.hedge.sent_us;
+    conn.hedge = Hedge(); // The socket now belongs to the connection
+    conn.health.hedge_wins++;
+
+    process_received(conn, buf, n);
+    if (conn.state == ConnState::RECEIVING) handle_readable(conn);
+}
+
+// Fail requests past their deadline, close idle connections past the idle
+// timeout and forget lights unused for a long time. Returns the next time
+// this needs to run.
+static int64_t expire(int64_t now) {
+    int64_t next = INT64_MAX;
+    for (auto it = s_connections.begin(); it != s_connections.end();) {
+        Connection &conn = it->second;
+
+        bool in_flight = conn.state == ConnState::CONNECTING || conn.state == ConnState::SENDING ||
+                         conn.state == ConnState::RECEIVING;
+        if (in_flight && conn.queue.front().attempt_deadline_us <= now) {
+            close_connection(conn);
+            PendingRequest &req = conn.queue.front();
+            if (req.attempt_deadline_us < req.deadline_us) {
+                // An attempt ran out but the caller's deadline has not: back
+                // off and try again on a fresh connection. Only the attempt
+                // that runs into the deadline counts towards the breaker.
+                ESP_LOGD(TAG, "Attempt to %s timed out, retrying", conn.host.c_str());
+                close_hedge(conn);
+                conn.health.backoff = std::min(conn.health.backoff + 1, MAX_RTO_BACKOFF);
+                req.retried = true;
+                start_request(conn);
+            } else {
+                fail_request(conn, "Timed out", true, true);
+            }
+        }
+        // Hedge a request that is running late and has no answer yet
+        if (conn.hedge_at_us && conn.state != ConnState::CLOSED && conn.state != ConnState::IDLE) {
+            if (now >= conn.hedge_at_us) {
+                conn.hedge_at_us = 0;
+                if (conn.response.received == 0) launch_hedge(conn);
+            } else {
+                next = std::min(next, conn.hedge_at_us);
+            }
+        }
+        // Queued requests that never got a socket
+        in_flight = conn.state != ConnState::CLOSED && conn.state != ConnState::IDLE;
+        for (auto q = conn.queue.begin() + (in_flight ? 1 : 0); q != conn.queue.end();) {
+            if (q->deadline_us <= now) {
+                PendingRequest req = std::move(*q);
+                q = conn.queue.erase(q);
+                respond_error(conn, req, "Timed out waiting for a connection");
+            } else {
+                ++q;
+            }
+        }
+        for (const auto &req : conn.queue) next = std::min(next, req.deadline_us);
+        if (in_flight) next = std::min(next, conn.queue.front().attempt_deadline_us);
+
+        // Probe a light the breaker has cut off once its backoff has passed
+        HostHealth &health = conn.health;
+        if (health.open && !health.probing && conn.queue.empty()) {
+            if (now >= health.next_probe_us) {
+                PendingRequest probe;
+                probe.method = HttpEngineMethod::GET;
+                probe.path = "/elgato/lights";
+                probe.submitted_us = now;
+                probe.deadline_us = now + MAX_RTO_US;
+                probe.adaptive = true;
+                probe.probe = true;
+                conn.queue.push_back(std::move(probe));
+                health.probing = true;
+                next = now; // Started by start_requests() on the next pass
+            } else {
+                next = std::min(next, health.next_probe_us);
+            }
+        }
+
+        if (conn.state == ConnState::IDLE && conn.queue.empty()) {
+            if (now - conn.last_used_us >= IDLE_TIMEOUT_US) {
+                close_connection(conn);
+            } else {
+                next = std::min(next, conn.last_used_us + IDLE_TIMEOUT_US);
+            }
+        }
+        if (conn.state == ConnState::CLOSED && conn.queue.empty() && now - conn.last_submitted_us >= FORGET_AFTER_US) {
+            xSemaphoreTake(s_stats_mutex, portMAX_DELAY);
+            s_stats.erase(it->first);
+            xSemaphoreGive(s_stats_mutex);
+            it = s_connections.erase(it);
+            continue;
+        }
+        ++it;
+    }
+    return next;
+}
+
+// Move submitted requests onto their light's queue.
+static void take_submissions() {
+    std::deque<Submission> batch;
+    xSemaphoreTake(s_inbox_mutex, portMAX_DELAY);
+    batch.swap(s_inbox);
+    xSemaphoreGive(s_inbox_mutex);
+
+    for (auto &sub : batch) {
+        std::string key = sub.ip + ":" + std::to_string(sub.port);
+        auto it = s_connections.find(key);
+        if (it == s_connections.end()) {
+            it = s_connections.emplace(key, Connection()).first;
+            init_connection(it->second, sub.ip, sub.port);
+        }
+        Connection &conn = it->second;
+        conn.last_submitted_us = esp_timer_get_time();
+        if (conn.last_used_us == 0) conn.last_used_us = conn.last_submitted_us;
+
+        // Fail fast while the light is known to be down
+        if (conn.health.open) {
+            conn.health.rejected++;
+            respond_error(conn, sub.request, "Light unreachable");
+            continue;
+        }
+        conn.queue.push_back(std::move(sub.request));
+    }
+}
+
+static void http_engine_task(void* pvParameters) {
+    while (1) {
+        take_submissions();
+        start_requests();
+        int64_t now = esp_timer_get_time();
+        int64_t deadline = expire(now);
+
+        fd_set readfds, writefds;
+        FD_ZERO(&readfds);
+        FD_ZERO(&writefds);
+        FD_SET(s_wake_fd, &readfds);
+        int max_fd = s_wake_fd;
+        for (auto &entry : s_connections) {
+            Connection &conn = entry.second;
+            if (conn.fd < 0) continue;
+            if (conn.state == ConnState::CONNECTING || conn.state == ConnState::SENDING) {
+                FD_SET(conn.fd, &writefds);
+            } else {
+                FD_SET(conn.fd, &readfds); // RECEIVING, or IDLE to notice the light closing it
+            }
+            max_fd = std::max(max_fd, conn.fd);
+
+            if (conn.hedge.fd >= 0) {
+                if (conn.hedge.state == ConnState::RECEIVING) {
+                    FD_SET(conn.hedge.fd, &readfds);
+                } else {
+                    FD_SET(conn.hedge.fd, &writefds);
+                }
+                max_fd = std::max(max_fd, conn.hedge.fd);
+            }
+        }
+
+        struct timeval tv;
+        struct timeval* timeout = nullptr;
+        if (deadline != INT64_MAX) {
+            int64_t wait_us = std::max<int64_t>(deadline - now, 0);
+            tv.tv_sec = wait_us / 1000000;
+            tv.tv_usec = wait_us % 1000000;
+            timeout = &tv;
+        }
+
+        int ready = select(max_fd + 1, &readfds, &writefds, NULL, timeout);
+        if (ready < 0) {
+            if (errno != EINTR) {
+                ESP_LOGW(TAG, "select() error: %s", strerror(errno));
+                vTaskDelay(pdMS_TO_TICKS(100));
+            }
+            continue;
+        }
+        if (ready == 0) continue;
+
+        if (FD_ISSET(s_wake_fd, &readfds)) {
+            uint64_t count;
+            read(s_wake_fd, &count, sizeof(count));
+        }
+        for (auto &entry : s_connections) {
+            Connection &conn = entry.second;
+            if (conn.fd < 0) continue;
+            int fd = conn.fd;
+            if (FD_ISSET(fd, &writefds)) {
+                handle_writable(conn);
+            } else if (FD_ISSET(fd, &readfds)) {
+                handle_readable(conn);
+            }
+
+            // Unless the original has just answered and dropped it
+            int hedge_fd = conn.hedge.fd;
+            if (hedge_fd < 0) continue;
+            if (FD_ISSET(hedge_fd, &writefds)) {
+                handle_hedge_writable(conn);
+            } else if (FD_ISSET(hedge_fd, &readfds)) {
+                handle_hedge_readable(conn);
+            }
+        }
+    }
+}
+
+bool http_engine_start() {
+    if (s_wake_fd >= 0) return true;
+
+    esp_vfs_eventfd_config_t config = ESP_VFS_EVENTD_CONFIG_DEFAULT();
+    esp_err_t err = esp_vfs_eventfd_register(&config);
+    if (err != ESP_OK && err != ESP_ERR_INVALID_STATE) { // Already registered is fine
+        ESP_LOGE(TAG, "Failed to register eventfd: %s", esp_err_to_name(err));
+        return false;
+    }
+
+    s_inbox_mutex = xSemaphoreCreateMutex();
+    s_stats_mutex = xSemaphoreCreateMutex();
+    int fd = eventfd(0, 0);
+    if (fd < 0 || !s_inbox_mutex || !s_stats_mutex) {
+        ESP_LOGE(TAG, "Failed to create engine wakeup");
+        return false;
+    }
+
+    s_wake_fd = fd;
+    if (xTaskCreatePinnedToCore(http_engine_task, "http_engine", 8192, NULL, 5, NULL, 0) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create engine task");
+        close(fd);
+        s_wake_fd = -1;
+        return false;
+    }
+    ESP_LOGI(TAG, "HTTP engine started (%d connections)", HTTP_ENGINE_MAX_CONNECTIONS);
+    return true;
+}
+
+bool http_engine_submit(const std::string &ip, uint16_t port, HttpEngineMethod method, const std::string &path,
+                        std::string body, HttpEngineCallback callback, uint32_t timeout_ms,
+                        HttpEngineBodySink sink, bool hedge) {
+    if (s_wake_fd < 0) return false;
+
+    Submission sub;
+    sub.ip = ip;
+    sub.port = port;
+    sub.request.method = method;
+    sub.request.path = path;
+    sub.request.body = std::move(body);
+    sub.request.callback = std::move(callback);
+    sub.request.sink = std::move(sink);
+    sub.request.hedge = hedge;
+    sub.request.submitted_us = esp_timer_get_time();
+    sub.request.adaptive = timeout_ms == HTTP_ENGINE_ADAPTIVE_TIMEOUT;
+    sub.request.deadline_us = sub.request.submitted_us +
+                              (int64_t)(sub.request.adaptive ? HTTP_ENGINE_MAX_TIMEOUT_MS : timeout_ms) * 1000;
+
+    xSemaphoreTake(s_inbox_mutex, portMAX_DELAY);
+    s_inbox.push_back(std::move(sub));
+    xSemaphoreGive(s_inbox_mutex);
+
+    uint64_t one = 1;
+    write(s_wake_fd, &one, sizeof(one));
+    return true;
+}
+
+void http_engine_set_hedging(bool enabled) {
+    s_hedging = enabled;
+}
+
+std::vector<HttpEngineHostStats> http_engine_stats() {
+    std::vector<HttpEngineHostStats> stats;
+    if (!s_stats_mutex) return stats;
+
+    xSemaphoreTake(s_stats_mutex, portMAX_DELAY);
+    stats.reserve(s_stats.size());
+    for (const auto &entry : s_stats) stats.push_back(entry.second);
+    xSemaphoreGive(s_stats_mutex);
+    return stats;
+}
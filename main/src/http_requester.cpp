@@ -2,16 +2,23 @@
 #include <cstring>
 #include <errno.h>
 #include <sstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <vector>
 
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 #include "esp_log.h"
 #include "esp_timer.h"
-#include "esp_http_client.h"
 
 extern "C" {
     #include <cJSON.h>
 }
 
 #include "http_requester.h"
+#include "http_engine.h"
+#include "json_fields.h"
 
 // --- Data Structure for Parsed Response ---
 
@@ -37,270 +44,391 @@ std::string DeviceInfo::toString() const {
     return ss.str();
 }
 
-// --- Manual JSON Parsing Helpers (Simplified for demonstration) ---
+// --- Streaming JSON Parsers ---
 
 /**
- * @brief Parses the JSON body string into the DeviceInfo struct.
+ * @brief Streams an /elgato/accessory-info response into a DeviceInfo.
  */
-DeviceInfo parseJsonBody(const std::string &json_body) {
+struct DeviceInfoParser {
     DeviceInfo info;
-    cJSON *root = cJSON_Parse(json_body.c_str());
-    if (!root) {
-        info.error = "Failed to parse JSON body.";
-        return info;
-    }
-
-    // Helper lambda for string extraction
-    auto getString = [root](const char* key) -> std::string {
-        cJSON *item = cJSON_GetObjectItemCaseSensitive(root, key);
-        if (cJSON_IsString(item) && (item->valuestring != nullptr)) {
-            return std::string(item->valuestring);
-        }
-        return "";
+    JsonField fields[8] = {
+        {"productName", nullptr, &info.productName},
+        {"hardwareBoardType", &info.hardwareBoardType},
+        {"hardwareRevision", nullptr, &info.hardwareRevision},
+        {"macAddress", nullptr, &info.macAddress},
+        {"firmwareBuildNumber", &info.firmwareBuildNumber},
+        {"firmwareVersion", nullptr, &info.firmwareVersion},
+        {"serialNumber", nullptr, &info.serialNumber},
+        {"displayName", nullptr, &info.displayName},
     };
+    JsonFieldExtractor extractor{fields, 8};
+    size_t bytes = 0;
 
-    // Helper lambda for int extraction
-    auto getInt = [root](const char* key) -> int {
-        cJSON *item = cJSON_GetObjectItemCaseSensitive(root, key);
-        if (cJSON_IsNumber(item)) {
-            return item->valueint;
-        }
-        return 0;
-    };
+    DeviceInfoParser() = default;
+    DeviceInfoParser(const DeviceInfoParser&) = delete;
+    DeviceInfoParser &operator=(const DeviceInfoParser&) = delete;
 
-    info.productName = getString("productName");
-    info.hardwareBoardType = getInt("hardwareBoardType");
-    info.hardwareRevision = getString("hardwareRevision");
-    info.macAddress = getString("macAddress");
-    info.firmwareBuildNumber = getInt("firmwareBuildNumber");
-    info.firmwareVersion = getString("firmwareVersion");
-    info.serialNumber = getString("serialNumber");
-    info.displayName = getString("displayName");
+    void feed(const char *data, size_t len) {
+        bytes += len;
+        extractor.feed(data, len);
+    }
 
-    cJSON_Delete(root);
-    return info;
-}
+    DeviceInfo finish() {
+        if (!extractor.finish()) {
+            info.error = "Failed to parse JSON body.";
+        }
+        return info;
+    }
+};
 
 /**
- * @brief Sends an HTTP PUT request with JSON body to a specified host, port, and path.
+ * @brief Streams an /elgato/lights response into an ElgatoLight, reading
+ * only the first light.
  */
-std::string sendHttpPutRequest(const std::string &host, const int &port, const std::string &path, const std::string &json_body) {
-    int64_t start_time = esp_timer_get_time();
+struct ElgatoLightParser {
+    ElgatoLight light;
+    JsonField fields[3] = {
+        {"lights.0.on", &light.on},
+        {"lights.0.brightness", &light.brightness},
+        {"lights.0.temperature", &light.temperature},
+    };
+    JsonFieldExtractor extractor{fields, 3};
 
-    // Construct full URL
-    char url[256];
-    snprintf(url, sizeof(url), "http://%s:%d%s", host.c_str(), port, path.c_str());
+    ElgatoLightParser() = default;
+    ElgatoLightParser(const ElgatoLightParser&) = delete;
+    ElgatoLightParser &operator=(const ElgatoLightParser&) = delete;
 
-    // Configure HTTP client
-    esp_http_client_config_t config = {};
-    config.url = url;
-    config.timeout_ms = 2000;
-    config.keep_alive_enable = true;
+    void feed(const char *data, size_t len) { extractor.feed(data, len); }
 
-    esp_http_client_handle_t client = esp_http_client_init(&config);
-    if (client == NULL) {
-        ESP_LOGE(TAG, "Failed to initialize HTTP client");
-        return "";
+    ElgatoLight finish() {
+        if (!extractor.finish()) {
+            light.error = "Failed to parse JSON response";
+        } else if (!fields[0].found && !fields[1].found && !fields[2].found) {
+            light.error = "No lights found in response";
+        }
+        return light;
     }
+};
 
-    // Set PUT method and headers
-    esp_http_client_set_method(client, HTTP_METHOD_PUT);
-    esp_http_client_set_header(client, "Content-Type", "application/json");
+/**
+ * @brief Runs one request on the HTTP engine and blocks until it completes.
+ *
+ * @param body Request body; empty for none.
+ * @param response Receives the response body, unless `sink` is given.
+ * @param sink Optional; receives the response body as it arrives.
+ * @return The HTTP status code, or -1 if no response was received.
+ */
+static int performRequest(const std::string &host, int port, HttpEngineMethod method,
+                          const std::string &path, const std::string &body, std::string &response,
+                          HttpEngineBodySink sink = nullptr) {
+    // Shared with the callback, which runs on the engine task
+    struct Waiter {
+        SemaphoreHandle_t done;
+        HttpEngineResponse response;
+    };
+    auto waiter = std::make_shared<Waiter>();
+    waiter->done = xSemaphoreCreateBinary();
+    if (waiter->done == NULL) {
+        return -1;
+    }
 
-    // Open connection and write request body
-    esp_err_t err = esp_http_client_open(client, json_body.length());
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to open: %s", esp_err_to_name(err));
-        esp_http_client_cleanup(client);
-        return "";
+    bool queued = http_engine_submit(host, port, method, path, body, [waiter](HttpEngineResponse &result) {
+        waiter->response = std::move(result);
+        xSemaphoreGive(waiter->done);
+    }, HTTP_ENGINE_ADAPTIVE_TIMEOUT, std::move(sink));
+    if (!queued) {
+        ESP_LOGE(TAG, "HTTP engine not running");
+        vSemaphoreDelete(waiter->done);
+        return -1;
     }
 
-    // Write request body
-    int wlen = esp_http_client_write(client, json_body.c_str(), json_body.length());
-    if (wlen < 0) {
-        ESP_LOGE(TAG, "Failed to write request body");
-        esp_http_client_close(client);
-        esp_http_client_cleanup(client);
-        return "";
+    // The engine always calls back, at the latest when the request times out
+    xSemaphoreTake(waiter->done, portMAX_DELAY);
+    vSemaphoreDelete(waiter->done);
+
+    if (waiter->response.status < 0) {
+        ESP_LOGE(TAG, "Request to %s:%d%s failed: %s", host.c_str(), port, path.c_str(),
+                 waiter->response.error.c_str());
     }
+    response = std::move(waiter->response.body);
+    return waiter->response.status;
+}
 
-    // Fetch response headers
-    esp_http_client_fetch_headers(client);
-    int status = esp_http_client_get_status_code(client);
+/**
+ * @brief Sends an HTTP PUT request with JSON body to a specified host, port, and path.
+ */
+std::string sendHttpPutRequest(const std::string &host, const int &port, const std::string &path, const std::string &json_body) {
+    int64_t start_time = esp_timer_get_time();
 
     std::string response;
-    if (status >= 200 && status < 300) {
-        // Read response data
-        char buffer[1024];
-        int read_len;
-
-        while ((read_len = esp_http_client_read(client, buffer, sizeof(buffer) - 1)) > 0) {
-            buffer[read_len] = '\0';
-            response.append(buffer, read_len);
-        }
+    int status = performRequest(host, port, HttpEngineMethod::PUT, path, json_body, response);
 
+    if (status >= 200 && status < 300) {
         int64_t elapsed_ms = (esp_timer_get_time() - start_time) / 1000;
-        ESP_LOGI(TAG, "PUT request to %s completed in %lld ms (status=%d)", 
-                 url, elapsed_ms, status);
-    } else {
-        ESP_LOGE(TAG, "PUT request failed with HTTP %d", status);
+        ESP_LOGI(TAG, "PUT request to %s:%d%s completed in %lld ms (status=%d)", 
+                 host.c_str(), port, path.c_str(), elapsed_ms, status);
+        return response;
     }
 
-    esp_http_client_close(client);
-
-    esp_http_client_cleanup(client);
-    return response;
+    ESP_LOGE(TAG, "PUT request failed with HTTP %d", status);
+    return "";
 }
 
 // --- Elgato API Functions ---
 
+// Longest body renderLightBody() can produce, plus the terminator
+static constexpr size_t LIGHT_BODY_MAX = sizeof("{\"numberOfLights\":1,\"lights\":[{\"on\":1,\"brightness\":-2147483648,\"temperature\":-2147483648}]}");
+
+// Write a decimal integer at `out`; returns the number of characters written.
+static size_t appendInt(char *out, int value) {
+    char digits[11];
+    size_t n = 0;
+    unsigned int v = value < 0 ? 0u - (unsigned int)value : (unsigned int)value;
+    do {
+        digits[n++] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v != 0);
+
+    size_t len = 0;
+    if (value < 0) out[len++] = '-';
+    while (n > 0) out[len++] = digits[--n];
+    return len;
+}
+
+static size_t appendLiteral(char *out, const char *text, size_t len) {
+    memcpy(out, text, len);
+    return len;
+}
+
 /**
- * @brief Parses Elgato lights JSON response.
+ * @brief Renders the PUT /elgato/lights body for one light into `out`,
+ * without touching the heap. Whether the temperature field is present is
+ * decided at compile time.
+ *
+ * @return Length of the body, excluding the terminator.
  */
-ElgatoLight parseElgatoLightsResponse(const std::string &json_body) {
-    ElgatoLight light;
-    cJSON *root = cJSON_Parse(json_body.c_str());
-    if (!root) {
-        light.error = "Failed to parse JSON response";
-        return light;
+template <bool WithTemperature>
+static size_t renderLightBody(char (&out)[LIGHT_BODY_MAX], int brightness, int temperature) {
+    static constexpr char head[] = "{\"numberOfLights\":1,\"lights\":[{\"on\":";
+    static constexpr char brightness_key[] = ",\"brightness\":";
+    static constexpr char temperature_key[] = ",\"temperature\":";
+    static constexpr char tail[] = "}]}";
+
+    size_t len = appendLiteral(out, head, sizeof(head) - 1);
+    out[len++] = brightness > 0 ? '1' : '0';
+    len += appendLiteral(out + len, brightness_key, sizeof(brightness_key) - 1);
+    len += appendInt(out + len, brightness);
+    if constexpr (WithTemperature) {
+        len += appendLiteral(out + len, temperature_key, sizeof(temperature_key) - 1);
+        len += appendInt(out + len, temperature);
     }
+    len += appendLiteral(out + len, tail, sizeof(tail) - 1);
+    out[len] = '\0';
+    return len;
+}
 
-    cJSON *lights_array = cJSON_GetObjectItemCaseSensitive(root, "lights");
-    if (!cJSON_IsArray(lights_array) || cJSON_GetArraySize(lights_array) == 0) {
-        light.error = "No lights found in response";
-        cJSON_Delete(root);
-        return light;
-    }
-
-    cJSON *first_light = cJSON_GetArrayItem(lights_array, 0);
-
-    cJSON *on = cJSON_GetObjectItemCaseSensitive(first_light, "on");
-    if (cJSON_IsNumber(on)) {
-        light.on = on->valueint;
+// Send one PUT /elgato/lights to the light. `callback` is called exactly once.
+static void sendLightUpdate(const std::string &ip, int brightness, std::optional<int> temperature,
+                            bool read_state, ElgatoLightCallback callback) {
+    char body[LIGHT_BODY_MAX];
+    size_t body_len = temperature.has_value()
+        ? renderLightBody<true>(body, brightness, temperature.value())
+        : renderLightBody<false>(body, brightness, 0);
+
+    // Send PUT request; the response is parsed as it streams in, or just
+    // drained off the connection when the caller does not need it
+    auto parser = read_state ? std::make_shared<ElgatoLightParser>() : nullptr;
+    HttpEngineBodySink sink = [parser](const char *data, size_t len) {
+        if (parser) parser->feed(data, len);
+    };
+    bool queued = http_engine_submit(ip, 9123, HttpEngineMethod::PUT, "/elgato/lights", std::string(body, body_len),
+                                     [ip, brightness, temperature, callback, parser](HttpEngineResponse &response) {
+        if (response.status < 200 || response.status >= 300) {
+            ElgatoLight failed;
+            failed.error = "Failed request: Update to " + ip;
+            ESP_LOGE(TAG, "%s: %s", failed.error.c_str(),
+                     response.status < 0 ? response.error.c_str() : ("HTTP " + std::to_string(response.status)).c_str());
+            callback(failed);
+            return;
+        }
+        if (!parser) {
+            ElgatoLight accepted;
+            accepted.on = brightness > 0 ? 1 : 0;
+            accepted.brightness = brightness;
+            accepted.temperature = temperature.value_or(0);
+            callback(accepted);
+            return;
+        }
+        callback(parser->finish());
+    }, HTTP_ENGINE_ADAPTIVE_TIMEOUT, std::move(sink), true); // Absolute state, so safe to send twice
+    if (!queued) {
+        ElgatoLight light;
+        light.error = "Failed request: Update to " + ip;
+        callback(light);
     }
+}
 
-    cJSON *brightness = cJSON_GetObjectItemCaseSensitive(first_light, "brightness");
-    if (cJSON_IsNumber(brightness)) {
-        light.brightness = brightness->valueint;
-    }
+/**
+ * @brief Per-light command slot. At most one update per light is on its way
+ * to the light; commands arriving meanwhile are merged into a single pending
+ * one, so a burst of slider updates costs at most two writes and the light
+ * ends at the latest value.
+ */
+struct LightCommandSlot {
+    bool has_pending = false;
+    int brightness = 0;
+    std::optional<int> temperature;
+    bool read_state = false;                    // Some caller wants the reported state
+    std::vector<ElgatoLightCallback> callbacks; // Waiting for the pending command
+};
+
+// Slots of lights with an update in flight, guarded by light_slots_mutex()
+static std::map<std::string, LightCommandSlot> s_light_slots;
+
+static SemaphoreHandle_t light_slots_mutex() {
+    static SemaphoreHandle_t mutex = xSemaphoreCreateMutex();
+    return mutex;
+}
 
-    cJSON *temperature = cJSON_GetObjectItemCaseSensitive(first_light, "temperature");
-    if (cJSON_IsNumber(temperature)) {
-        light.temperature = temperature->valueint;
+static void sendSlotCommand(const std::string &ip, int brightness, std::optional<int> temperature,
+                            bool read_state, std::vector<ElgatoLightCallback> callbacks);
+
+// The update in flight to `ip` finished: send the pending command, if any,
+// or release the slot.
+static void lightUpdateDone(const std::string &ip) {
+    xSemaphoreTake(light_slots_mutex(), portMAX_DELAY);
+    auto it = s_light_slots.find(ip);
+    if (it == s_light_slots.end() || !it->second.has_pending) {
+        if (it != s_light_slots.end()) s_light_slots.erase(it);
+        xSemaphoreGive(light_slots_mutex());
+        return;
     }
+    LightCommandSlot &slot = it->second;
+    int brightness = slot.brightness;
+    std::optional<int> temperature = slot.temperature;
+    bool read_state = slot.read_state;
+    std::vector<ElgatoLightCallback> callbacks = std::move(slot.callbacks);
+    slot.callbacks.clear();
+    slot.has_pending = false;
+    slot.temperature.reset();
+    slot.read_state = false;
+    xSemaphoreGive(light_slots_mutex());
+
+    sendSlotCommand(ip, brightness, temperature, read_state, std::move(callbacks));
+}
 
-    cJSON_Delete(root);
-    return light;
+static void sendSlotCommand(const std::string &ip, int brightness, std::optional<int> temperature,
+                            bool read_state, std::vector<ElgatoLightCallback> callbacks) {
+    sendLightUpdate(ip, brightness, temperature, read_state, [ip, callbacks](const ElgatoLight &light) {
+        // Start the next write before reporting, so the light stays busy
+        lightUpdateDone(ip);
+        for (const auto &callback : callbacks) callback(light);
+    });
 }
 
-ElgatoLight setLight(const std::string &ip, int brightness, std::optional<int> temperature) {
+void setLightAsync(const std::string &ip, int brightness, std::optional<int> temperature, ElgatoLightCallback callback,
+                   bool read_state) {
     ElgatoLight light;
 
     // Validate parameters
     if (brightness < 0 || brightness > 100) {
         light.error = "Brightness must be between 0 and 100";
         ESP_LOGE(TAG, "%s", light.error.c_str());
-        return light;
+        callback(light);
+        return;
     }
 
     if (temperature.has_value() && (temperature.value() < 143 || temperature.value() > 344)) {
         light.error = "Temperature must be between 143 and 344";
         ESP_LOGE(TAG, "%s", light.error.c_str());
-        return light;
+        callback(light);
+        return;
     }
 
-    // Create JSON body
-    cJSON *root = cJSON_CreateObject();
-    cJSON_AddNumberToObject(root, "numberOfLights", 1);
-
-    cJSON *lights_array = cJSON_CreateArray();
-    cJSON *light_obj = cJSON_CreateObject();
-    cJSON_AddNumberToObject(light_obj, "on", brightness > 0 ? 1 : 0);
-    cJSON_AddNumberToObject(light_obj, "brightness", brightness);
-
-    // Only add temperature if provided
-    if (temperature.has_value()) {
-        cJSON_AddNumberToObject(light_obj, "temperature", temperature.value());
-    }
-
-    cJSON_AddItemToArray(lights_array, light_obj);
-    cJSON_AddItemToObject(root, "lights", lights_array);
-
-    char *json_string = cJSON_PrintUnformatted(root);
-    std::string json_body(json_string);
-    cJSON_free(json_string);
-    cJSON_Delete(root);
-
-    // Send PUT request
-    std::string response = sendHttpPutRequest(ip, 9123, "/elgato/lights", json_body);
-
-    if (response.empty()) {
-        light.error = "Failed request: Update to " + ip;
-        ESP_LOGE(TAG, "%s", light.error.c_str());
-        return light;
+    xSemaphoreTake(light_slots_mutex(), portMAX_DELAY);
+    auto it = s_light_slots.find(ip);
+    if (it != s_light_slots.end()) {
+        // An update is already on its way: this command replaces any pending
+        // one. A temperature set by the replaced command is kept unless this
+        // one sets its own, so the light ends as if both had been sent.
+        LightCommandSlot &slot = it->second;
+        if (slot.has_pending) {
+            ESP_LOGD(TAG, "Superseded pending command for %s", ip.c_str());
+        }
+        slot.has_pending = true;
+        slot.brightness = brightness;
+        if (temperature.has_value()) slot.temperature = temperature;
+        if (read_state) slot.read_state = true;
+        slot.callbacks.push_back(std::move(callback));
+        xSemaphoreGive(light_slots_mutex());
+        return;
     }
+    s_light_slots.emplace(ip, LightCommandSlot());
+    xSemaphoreGive(light_slots_mutex());
 
-    // Parse response
-    return parseElgatoLightsResponse(response);
+    std::vector<ElgatoLightCallback> callbacks;
+    callbacks.push_back(std::move(callback));
+    sendSlotCommand(ip, brightness, temperature, read_state, std::move(callbacks));
 }
 
-ElgatoLight getLight(const std::string &ip) {
-    ElgatoLight light;
-
-    // Construct URL
-    char url[256];
-    snprintf(url, sizeof(url), "http://%s:9123/elgato/lights", ip.c_str());
-
-    // Configure HTTP client
-    esp_http_client_config_t config = {};
-    config.url = url;
-    config.timeout_ms = 2000;
-    config.keep_alive_enable = true;
+bool lightUpdatePending(const std::string &ip) {
+    xSemaphoreTake(light_slots_mutex(), portMAX_DELAY);
+    bool pending = s_light_slots.count(ip) > 0;
+    xSemaphoreGive(light_slots_mutex());
+    return pending;
+}
 
-    esp_http_client_handle_t client = esp_http_client_init(&config);
-    if (client == NULL) {
+void getLightAsync(const std::string &ip, ElgatoLightCallback callback) {
+    auto parser = std::make_shared<ElgatoLightParser>();
+    bool queued = http_engine_submit(ip, 9123, HttpEngineMethod::GET, "/elgato/lights", "",
+                                     [ip, callback, parser](HttpEngineResponse &response) {
+        if (response.status >= 200 && response.status < 300) {
+            callback(parser->finish());
+            return;
+        }
+        ElgatoLight light;
+        light.error = response.status < 0 ? "Failed request: Getting light info for " + ip
+                                          : "HTTP " + std::to_string(response.status);
+        ESP_LOGE(TAG, "GET light failed with status %d", response.status);
+        callback(light);
+    }, HTTP_ENGINE_ADAPTIVE_TIMEOUT, [parser](const char *data, size_t len) { parser->feed(data, len); });
+    if (!queued) {
+        ElgatoLight light;
         light.error = "Failed request: Getting light info for " + ip;
-        ESP_LOGE(TAG, "%s", light.error.c_str());
-        return light;
+        callback(light);
     }
+}
 
-    // Open connection
-    esp_err_t err = esp_http_client_open(client, 0);
-    if (err != ESP_OK) {
-        light.error = "Failed to open: " + std::string(esp_err_to_name(err));
-        ESP_LOGE(TAG, "%s", light.error.c_str());
-        esp_http_client_cleanup(client);
+// Block the calling task until an async light call completes.
+static ElgatoLight waitForLight(const std::function<void(ElgatoLightCallback)> &start) {
+    struct Waiter {
+        SemaphoreHandle_t done;
+        ElgatoLight light;
+    };
+    auto waiter = std::make_shared<Waiter>();
+    waiter->done = xSemaphoreCreateBinary();
+    if (waiter->done == NULL) {
+        ElgatoLight light;
+        light.error = "Out of memory";
         return light;
     }
 
-    // Fetch headers
-    esp_http_client_fetch_headers(client);
-    int status = esp_http_client_get_status_code(client);
-
-    if (status >= 200 && status < 300) {
-        // Read response data
-        char buffer[1024];
-        int read_len;
-        std::string json_body;
-
-        while ((read_len = esp_http_client_read(client, buffer, sizeof(buffer) - 1)) > 0) {
-            buffer[read_len] = '\0';
-            json_body.append(buffer, read_len);
-        }
+    start([waiter](const ElgatoLight &light) {
+        waiter->light = light;
+        xSemaphoreGive(waiter->done);
+    });
 
-        esp_http_client_close(client);
-        esp_http_client_cleanup(client);
+    xSemaphoreTake(waiter->done, portMAX_DELAY);
+    vSemaphoreDelete(waiter->done);
+    return waiter->light;
+}
 
-        if (!json_body.empty()) {
-            return parseElgatoLightsResponse(json_body);
-        }
-    }
+ElgatoLight setLight(const std::string &ip, int brightness, std::optional<int> temperature) {
+    return waitForLight([&](ElgatoLightCallback done) { setLightAsync(ip, brightness, temperature, done); });
+}
 
-    light.error = "HTTP " + std::to_string(status);
-    ESP_LOGE(TAG, "GET light failed with status %d", status);
-    esp_http_client_close(client);
-    esp_http_client_cleanup(client);
-    return light;
+ElgatoLight getLight(const std::string &ip) {
+    return waitForLight([&](ElgatoLightCallback done) { getLightAsync(ip, done); });
 }
 
 DeviceInfo getInfo(const std::string &ip) {
@@ -344,71 +472,28 @@ bool setDeviceName(const std::string &ip, const std::string &name) {
 DeviceInfo sendHttpGetRequest(const std::string &host, const int &port, const std::string &path) {
     DeviceInfo error_result;
 
-    // Construct URL
-    char url[256];
-    snprintf(url, sizeof(url), "http://%s:%d%s", host.c_str(), port, path.c_str());
+    // The caller's stack outlives the request: performRequest() waits for it
+    DeviceInfoParser parser;
+    std::string unused;
+    int status = performRequest(host, port, HttpEngineMethod::GET, path, "", unused,
+                                [&parser](const char *data, size_t len) { parser.feed(data, len); });
 
-    // Configure HTTP client
-    esp_http_client_config_t config = {};
-    config.url = url;
-    config.timeout_ms = 2000;
-    config.keep_alive_enable = true;
-
-    esp_http_client_handle_t client = esp_http_client_init(&config);
-    if (client == NULL) {
-        error_result.error = "Failed to initialize HTTP client";
-        ESP_LOGE(TAG, "%s", error_result.error.c_str());
-        return error_result;
-    }
+    ESP_LOGI(TAG, "GET %s:%d%s -> HTTP %d (%d bytes)", host.c_str(), port, path.c_str(), status, parser.bytes);
 
-    // Open connection and fetch headers
-    esp_err_t err = esp_http_client_open(client, 0);
-    if (err != ESP_OK) {
-        error_result.error = "Failed to open connection: " + std::string(esp_err_to_name(err));
+    if (status < 0) {
+        error_result.error = "Failed to open connection to " + host;
         ESP_LOGE(TAG, "%s", error_result.error.c_str());
-        esp_http_client_cleanup(client);
-        return error_result;
-    }
-
-    // Fetch headers
-    int content_length = esp_http_client_fetch_headers(client);
-    int status = esp_http_client_get_status_code(client);
-
-    ESP_LOGI(TAG, "GET %s -> HTTP %d (Content-Length: %d)", url, status, content_length);
-
-    if (status >= 200 && status < 300) {
-        // Read response body
-        char buffer[2048];
-        int total_read = 0;
-        int read_len;
-        std::string json_body;
-
-        while ((read_len = esp_http_client_read(client, buffer, sizeof(buffer) - 1)) > 0) {
-            buffer[read_len] = '\0';
-            json_body.append(buffer, read_len);
-            total_read += read_len;
-        }
-
-        esp_http_client_close(client);
-        esp_http_client_cleanup(client);
-
-        if (!json_body.empty()) {
-            ESP_LOGI(TAG, "Successfully read %d bytes", total_read);
-
-            // Parse the JSON body
-            DeviceInfo info = parseJsonBody(json_body);
-            info.ip = host;
-            return info;
-        } else {
-            error_result.error = "Empty response body";
-            ESP_LOGE(TAG, "%s", error_result.error.c_str());
-        }
-    } else {
+    } else if (status < 200 || status >= 300) {
         error_result.error = "HTTP status " + std::to_string(status);
         ESP_LOGE(TAG, "Bad HTTP status: %d", status);
-        esp_http_client_close(client);
+    } else if (parser.bytes == 0) {
+        error_result.error = "Empty response body";
+        ESP_LOGE(TAG, "%s", error_result.error.c_str());
+    } else {
+        DeviceInfo info = parser.finish();
+        info.ip = host;
+        return info;
     }
 
-    esp_http_client_cleanup(client);
     return error_result;
 }
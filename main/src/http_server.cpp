@@ -1,8 +1,15 @@
+#include <atomic>
+#include <memory>
 #include <string>
 #include <map>
+#include <optional>
+#include <vector>
+#include <cstdio>
 #include <cstring>
 
 #include "esp_log.h"
+#include "esp_random.h"
+#include "esp_timer.h"
 
 extern "C" {
     #include <cJSON.h>
@@ -12,60 +19,171 @@ extern "C" {
 #include "http_server.h"
 #include "http_requester.h"
 #include "cache_lights.h"
+#include "light_fanout.h"
+#include "http_engine.h"
+#include "json_writer.h"
 
 static const char* TAG = "HTTP_SERVER";
 
-// Add a cached JSON response that's updated periodically
-struct ServerCache {
-    std::string cached_devices_json;
-    SemaphoreHandle_t mutex;
-
-    ServerCache() {
-        mutex = xSemaphoreCreateMutex();
-        cached_devices_json = "[]";
-    }
+// Serialized body of a GET endpoint for one generation of the data behind
+// it. Never modified once published: a handler pins the current snapshot
+// and sends straight from it, while a newer one may replace it.
+struct JsonSnapshot {
+    uint32_t generation = 0;
+    std::string json;
+    char etag[24];   // Strong ETag, quoted
 };
+using JsonSnapshotPtr = std::shared_ptr<const JsonSnapshot>;
 
 struct ServerContext {
-    const std::map<std::string, DeviceInfo>* device_map;
-    const std::map<std::string, DeviceInfo>* device_serial_map;
+    const DeviceRegistry* device_registry;
     LightGroupCache* light_group_cache;
+    LightStateMirror* light_state;
 };
 
-static ServerCache* server_cache = nullptr;
+// Latest snapshot per cached endpoint, swapped atomically
+static std::atomic<JsonSnapshotPtr> s_all_lights_json;
+static std::atomic<JsonSnapshotPtr> s_light_groups_json;
+
+// Random per boot and part of every ETag, since generations restart at zero
+static uint32_t s_boot_tag = 0;
+
+// Clients may keep cached bodies but must revalidate them with If-None-Match
+static const char* CACHE_CONTROL = "no-cache";
 
 // --- Utility Functions ---
 
 /**
- * @brief Converts the device map to a JSON string.
+ * @brief Writes the device list as a JSON array.
  */
-static std::string device_map_to_json(const std::map<std::string, DeviceInfo> *device_map) {
-    cJSON *root = cJSON_CreateArray();
+static void write_device_list(JsonWriter &writer, const std::vector<DeviceInfo> &devices) {
+    writer.begin_array();
+    for (const DeviceInfo& info : devices) {
+        writer.begin_object();
+        writer.field("serialNumber", info.serialNumber);
+        writer.field("ip", info.ip);
+        writer.field("productName", info.productName);
+        writer.field("hardwareBoardType", info.hardwareBoardType);
+        writer.field("hardwareRevision", info.hardwareRevision);
+        writer.field("macAddress", info.macAddress);
+        writer.field("firmwareBuildNumber", info.firmwareBuildNumber);
+        writer.field("firmwareVersion", info.firmwareVersion);
+        writer.field("displayName", info.displayName);
+        writer.end_object();
+    }
+    writer.end_array();
+}
 
-    for (const auto& pair : *device_map) {
-        const DeviceInfo& info = pair.second;
+/**
+ * @brief Writes the light groups as a JSON object.
+ */
+static void write_light_groups(JsonWriter &writer, const std::map<std::string, std::vector<std::string>> &groups) {
+    writer.begin_object();
+    writer.key("groups");
+    writer.begin_array();
+    for (const auto& groupPair : groups) {
+        writer.begin_object();
+        writer.field("groupName", groupPair.first);
+        writer.key("serialNumbers");
+        writer.begin_array();
+        for (const auto& serial : groupPair.second) {
+            writer.string(serial);
+        }
+        writer.end_array();
+        writer.field("deviceCount", groupPair.second.size());
+        writer.end_object();
+    }
+    writer.end_array();
+    writer.field("totalGroups", groups.size());
+    writer.end_object();
+}
 
-        cJSON *device = cJSON_CreateObject();
-        cJSON_AddStringToObject(device, "serialNumber", info.serialNumber.c_str());
-        cJSON_AddStringToObject(device, "ip", info.ip.c_str());
-        cJSON_AddStringToObject(device, "productName", info.productName.c_str());
-        cJSON_AddNumberToObject(device, "hardwareBoardType", info.hardwareBoardType);
-        cJSON_AddStringToObject(device, "hardwareRevision", info.hardwareRevision.c_str());
-        cJSON_AddStringToObject(device, "macAddress", info.macAddress.c_str());
-        cJSON_AddNumberToObject(device, "firmwareBuildNumber", info.firmwareBuildNumber);
-        cJSON_AddStringToObject(device, "firmwareVersion", info.firmwareVersion.c_str());
-        cJSON_AddStringToObject(device, "displayName", info.displayName.c_str());
+/**
+ * @brief Flush function that sends a JsonWriter's output as response
+ * chunks. End the response with httpd_resp_send_chunk(req, NULL, 0).
+ */
+static JsonWriterFlush chunkedResponse(httpd_req_t *req) {
+    return [req](const char *data, size_t len) {
+        return httpd_resp_send_chunk(req, data, len) == ESP_OK;
+    };
+}
 
-        cJSON_AddItemToArray(root, device);
+/**
+ * @brief Writes one light's entry in a control result. `device` is null
+ * for a serial that matched no light, and `command` is null with it.
+ * `with_state` adds the brightness and temperature the light reported.
+ */
+static void write_light_result(JsonWriter &writer, const std::string &serial, const DeviceInfo* device,
+                               const LightCommand* command, bool with_state) {
+    writer.begin_object();
+    writer.field("serial", serial);
+    if (!device) {
+        writer.field("success", false);
+        writer.field("error", "Device not found");
+        writer.end_object();
+        return;
     }
 
-    char *json_string = cJSON_Print(root);
-    std::string result(json_string);
+    const ElgatoLight& light = command->result;
+    writer.field("displayName", device->displayName);
+    writer.field("success", light.error.empty());
+    if (!light.error.empty()) {
+        writer.field("error", light.error);
+    } else if (with_state) {
+        writer.field("brightness", light.brightness);
+        writer.field("temperature", light.temperature);
+        if (command->skipped) {
+            writer.field("unchanged", true);
+        }
+    }
+    writer.end_object();
+}
 
-    cJSON_free(json_string);
-    cJSON_Delete(root);
+/**
+ * @brief Returns the snapshot in `slot`, first replacing it with a fresh
+ * one from `build` if it is missing or older than `generation`.
+ */
+template <typename Build>
+static JsonSnapshotPtr currentSnapshot(std::atomic<JsonSnapshotPtr> &slot, uint32_t generation, Build build) {
+    JsonSnapshotPtr snapshot = slot.load();
+    if (!snapshot || snapshot->generation != generation) {
+        std::shared_ptr<JsonSnapshot> fresh = build();
+        snprintf(fresh->etag, sizeof(fresh->etag), "\"%08lx-%lx\"", (unsigned long)s_boot_tag,
+                 (unsigned long)fresh->generation);
+        snapshot = fresh;
+        slot.store(snapshot);
+    }
+    return snapshot;
+}
 
-    return result;
+/**
+ * @brief True if the request's If-None-Match lists `etag` (or is "*").
+ */
+static bool clientHasEtag(httpd_req_t *req, const char *etag) {
+    char value[128];
+    if (httpd_req_get_hdr_value_str(req, "If-None-Match", value, sizeof(value)) != ESP_OK) return false;
+    // Weak comparison, as RFC 9110 asks for If-None-Match: a W/ prefix still matches
+    return strcmp(value, "*") == 0 || strstr(value, etag) != nullptr;
+}
+
+/**
+ * @brief Sends a snapshot with its ETag, or an empty 304 Not Modified if the
+ * client already holds this version.
+ */
+static esp_err_t sendSnapshot(httpd_req_t *req, const JsonSnapshotPtr &snapshot) {
+    // The snapshot outlives the send, so its ETag can be handed over as is
+    httpd_resp_set_hdr(req, "ETag", snapshot->etag);
+    httpd_resp_set_hdr(req, "Cache-Control", CACHE_CONTROL);
+
+    if (clientHasEtag(req, snapshot->etag)) {
+        httpd_resp_set_status(req, "304 Not Modified");
+        httpd_resp_send(req, NULL, 0);
+        return ESP_OK;
+    }
+
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_send(req, snapshot->json.data(), snapshot->json.length());
+    return ESP_OK;
 }
 
 // --- Route Handler Functions ---
@@ -73,72 +191,135 @@ static std::string device_map_to_json(const std::map<std::string, DeviceInfo> *d
 
 /**
  * @brief Handler for GET /lights/all - returns all discovered devices.
- * Now uses cached response for instant, non-blocking replies.
+ * The JSON is serialized again only after the device registry changes, and
+ * a client that sends back the ETag of the current version gets a 304.
  */
 static esp_err_t handleGetAllLights(httpd_req_t *req) {
-    if (!server_cache) {
-        httpd_resp_set_status(req, "503 Service Unavailable");
-        httpd_resp_send(req, "{\"error\":\"Server cache not initialized\"}", HTTPD_RESP_USE_STRLEN);
-        return ESP_OK;
-    }
+    ServerContext* ctx = (ServerContext*)req->user_ctx;
 
-    // Use cached JSON instead of generating on-the-fly
-    std::string json;
-    if (xSemaphoreTake(server_cache->mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
-        json = server_cache->cached_devices_json;
-        xSemaphoreGive(server_cache->mutex);
-    } else {
-        httpd_resp_set_status(req, "503 Service Unavailable");
-        httpd_resp_send(req, "{\"error\":\"Cache busy\"}", HTTPD_RESP_USE_STRLEN);
-        return ESP_OK;
+    JsonSnapshotPtr snapshot = currentSnapshot(s_all_lights_json, ctx->device_registry->generation(), [ctx] {
+        auto fresh = std::make_shared<JsonSnapshot>();
+        JsonWriter writer(json_writer_to_string(fresh->json));
+        write_device_list(writer, ctx->device_registry->all(&fresh->generation));
+        writer.finish();
+        ESP_LOGD(TAG, "Serialized device list (%d bytes)", fresh->json.length());
+        return fresh;
+    });
+
+    return sendSnapshot(req, snapshot);
+}
+
+/**
+ * @brief Handler for GET /lights/state - returns the last known state of
+ * every light from the state mirror, without contacting the lights.
+ */
+static esp_err_t handleGetLightStates(httpd_req_t *req) {
+    ServerContext* ctx = (ServerContext*)req->user_ctx;
+    int64_t now = esp_timer_get_time();
+
+    cJSON *root = cJSON_CreateArray();
+    for (const DeviceInfo& info : ctx->device_registry->all()) {
+        cJSON *device = cJSON_CreateObject();
+        cJSON_AddStringToObject(device, "serialNumber", info.serialNumber.c_str());
+        cJSON_AddStringToObject(device, "displayName", info.displayName.c_str());
+        cJSON_AddStringToObject(device, "ip", info.ip.c_str());
+
+        std::optional<MirroredLight> mirrored = ctx->light_state->get(info.ip);
+        if (mirrored && mirrored->known) {
+            cJSON *state = cJSON_CreateObject();
+            cJSON_AddNumberToObject(state, "on", mirrored->state.on);
+            cJSON_AddNumberToObject(state, "brightness", mirrored->state.brightness);
+            cJSON_AddNumberToObject(state, "temperature", mirrored->state.temperature);
+            cJSON_AddBoolToObject(state, "reachable", mirrored->reachable);
+            cJSON_AddNumberToObject(state, "ageMs", (double)((now - mirrored->confirmed_us) / 1000));
+            cJSON_AddItemToObject(device, "state", state);
+        } else {
+            cJSON_AddNullToObject(device, "state");
+        }
+        cJSON_AddItemToArray(root, device);
     }
 
+    char *json_str = cJSON_PrintUnformatted(root);
     httpd_resp_set_type(req, "application/json");
-    httpd_resp_send(req, json.c_str(), json.length());
+    httpd_resp_send(req, json_str, strlen(json_str));
 
+    cJSON_free(json_str);
+    cJSON_Delete(root);
     return ESP_OK;
 }
 
 /**
- * @brief Handler for GET /lights/group - returns all light groups.
+ * @brief Handler for GET /lights/health - returns round-trip times, timeouts
+ * and circuit breaker state for every light the HTTP engine talks to.
  */
-static esp_err_t handleGetLightGroups(httpd_req_t *req) {
+static esp_err_t handleGetLightHealth(httpd_req_t *req) {
     ServerContext* ctx = (ServerContext*)req->user_ctx;
+    int64_t now = esp_timer_get_time();
 
-    // Get all groups from cache
-    std::map<std::string, std::vector<std::string>> allGroups = ctx->light_group_cache->getAllGroups();
-
-    // Build JSON response
-    cJSON *root = cJSON_CreateObject();
-    cJSON *groupsArray = cJSON_CreateArray();
-
-    for (const auto& groupPair : allGroups) {
-        cJSON *groupObj = cJSON_CreateObject();
-        cJSON_AddStringToObject(groupObj, "groupName", groupPair.first.c_str());
+    std::map<std::string, DeviceInfo> by_ip;
+    for (const DeviceInfo& info : ctx->device_registry->all()) {
+        by_ip[info.ip] = info;
+    }
 
-        cJSON *serialsArray = cJSON_CreateArray();
-        for (const auto& serial : groupPair.second) {
-            cJSON_AddItemToArray(serialsArray, cJSON_CreateString(serial.c_str()));
+    cJSON *root = cJSON_CreateArray();
+    for (const HttpEngineHostStats& stats : http_engine_stats()) {
+        cJSON *host = cJSON_CreateObject();
+        cJSON_AddStringToObject(host, "ip", stats.ip.c_str());
+        cJSON_AddNumberToObject(host, "port", stats.port);
+        auto device = by_ip.find(stats.ip);
+        if (device != by_ip.end()) {
+            cJSON_AddStringToObject(host, "serialNumber", device->second.serialNumber.c_str());
+            cJSON_AddStringToObject(host, "displayName", device->second.displayName.c_str());
         }
-
-        cJSON_AddItemToObject(groupObj, "serialNumbers", serialsArray);
-        cJSON_AddNumberToObject(groupObj, "deviceCount", groupPair.second.size());
-        cJSON_AddItemToArray(groupsArray, groupObj);
+        cJSON_AddNumberToObject(host, "srttMs", stats.srtt_ms);
+        cJSON_AddNumberToObject(host, "rttvarMs", stats.rttvar_ms);
+        cJSON_AddNumberToObject(host, "timeoutMs", stats.timeout_ms);
+        cJSON_AddNumberToObject(host, "samples", stats.samples);
+        cJSON_AddNumberToObject(host, "p95Ms", stats.p95_ms);
+        cJSON_AddNumberToObject(host, "hedges", stats.hedges);
+        cJSON_AddNumberToObject(host, "hedgeWins", stats.hedge_wins);
+        cJSON_AddNumberToObject(host, "successes", stats.successes);
+        cJSON_AddNumberToObject(host, "failures", stats.failures);
+        cJSON_AddNumberToObject(host, "rejected", stats.rejected);
+        cJSON_AddNumberToObject(host, "consecutiveFailures", stats.consecutive_failures);
+        cJSON_AddStringToObject(host, "circuit", stats.circuit_open ? "open" : "closed");
+        if (stats.circuit_open) {
+            int64_t probe_in_ms = stats.next_probe_us > now ? (stats.next_probe_us - now) / 1000 : 0;
+            cJSON_AddNumberToObject(host, "nextProbeMs", (double)probe_in_ms);
+        }
+        cJSON_AddItemToArray(root, host);
     }
 
-    cJSON_AddItemToObject(root, "groups", groupsArray);
-    cJSON_AddNumberToObject(root, "totalGroups", allGroups.size());
-
     char *json_str = cJSON_PrintUnformatted(root);
     httpd_resp_set_type(req, "application/json");
     httpd_resp_send(req, json_str, strlen(json_str));
 
     cJSON_free(json_str);
     cJSON_Delete(root);
-
     return ESP_OK;
 }
 
+/**
+ * @brief Handler for GET /lights/group - returns all light groups.
+ * The JSON is serialized again only after the groups change; conditional
+ * requests work as for GET /lights/all.
+ */
+static esp_err_t handleGetLightGroups(httpd_req_t *req) {
+    ServerContext* ctx = (ServerContext*)req->user_ctx;
+
+    uint32_t generation = ctx->light_group_cache->getGeneration();
+    JsonSnapshotPtr snapshot = currentSnapshot(s_light_groups_json, generation, [ctx, generation] {
+        auto fresh = std::make_shared<JsonSnapshot>();
+        fresh->generation = generation;
+        JsonWriter writer(json_writer_to_string(fresh->json));
+        write_light_groups(writer, ctx->light_group_cache->getAllGroups());
+        writer.finish();
+        return fresh;
+    });
+
+    return sendSnapshot(req, snapshot);
+}
+
 /**
  * @brief Handler for PUT /lights/group - creates or updates a light group.
  * Expects JSON body: {"groupName": "...", "serialNumbers": ["...", ...]}
@@ -245,9 +426,106 @@ static esp_err_t handleSetLightGroup(httpd_req_t *req) {
     return ESP_OK;
 }
 
+/**
+ * @brief True if the query string sets the flag `name`, as "name=1" or
+ * "name=true".
+ */
+static bool queryFlag(httpd_req_t *req, const char *name) {
+    char query[48];
+    char value[8];
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK) return false;
+    if (httpd_query_key_value(query, name, value, sizeof(value)) != ESP_OK) return false;
+    return strcmp(value, "1") == 0 || strcmp(value, "true") == 0;
+}
+
+/**
+ * @brief Queues fire-and-forget commands and answers 202 Accepted at once.
+ * `not_found` counts lights that could not be addressed.
+ */
+static esp_err_t sendCommandsAccepted(httpd_req_t *req, ServerContext* ctx, std::vector<LightCommand> &commands,
+                                      size_t not_found) {
+    size_t queued = fanout_set_lights_async(commands, ctx->light_state);
+
+    char body[96];
+    int len = snprintf(body, sizeof(body), "{\"queued\":%u,\"unchanged\":%u,\"notFound\":%u}",
+                       (unsigned)queued, (unsigned)(commands.size() - queued), (unsigned)not_found);
+    httpd_resp_set_status(req, "202 Accepted");
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_send(req, body, len);
+
+    ESP_LOGI(TAG, "Queued %u commands (%u unchanged, %u not found)", (unsigned)queued,
+             (unsigned)(commands.size() - queued), (unsigned)not_found);
+    return ESP_OK;
+}
+
+/**
+ * @brief Runs group control and streams the outcome as newline-delimited
+ * JSON: one line per light, in the order the lights finish, then a line
+ * with "summary": true and the totals.
+ *
+ * `commands` holds one command per serial that resolved to a device, in
+ * serial order.
+ */
+static esp_err_t streamGroupControl(httpd_req_t *req, ServerContext* ctx, const std::string &groupName,
+                                    const std::vector<std::string> &serialNumbers,
+                                    const std::vector<std::optional<DeviceInfo>> &devices,
+                                    std::vector<LightCommand> &commands) {
+    httpd_resp_set_type(req, "application/x-ndjson");
+    JsonWriter writer(chunkedResponse(req));
+    int successCount = 0;
+    int failCount = 0;
+
+    // Serials that matched no light have failed already; find each
+    // command's serial on the way
+    std::vector<size_t> serial_of_command;
+    for (size_t i = 0; i < serialNumbers.size(); ++i) {
+        if (devices[i]) {
+            serial_of_command.push_back(i);
+            continue;
+        }
+        ESP_LOGW(TAG, "Serial '%s' not found in device map", serialNumbers[i].c_str());
+        failCount++;
+        write_light_result(writer, serialNumbers[i], nullptr, nullptr, true);
+        writer.end_record();
+    }
+    writer.flush();
+
+    fanout_set_lights(commands, ctx->light_state, [&](const LightCommand &command) {
+        size_t i = serial_of_command[&command - commands.data()];
+        const DeviceInfo& deviceInfo = *devices[i];
+        if (command.result.error.empty()) {
+            successCount++;
+            ESP_LOGI(TAG, "Successfully controlled %s", deviceInfo.displayName.c_str());
+        } else {
+            failCount++;
+            ESP_LOGW(TAG, "Failed to control %s: %s", deviceInfo.displayName.c_str(), command.result.error.c_str());
+        }
+        write_light_result(writer, serialNumbers[i], &deviceInfo, &command, true);
+        writer.end_record();
+        writer.flush(); // Out to the client now, not when the buffer fills
+    });
+
+    writer.begin_object();
+    writer.field("summary", true);
+    writer.field("groupName", groupName);
+    writer.field("totalDevices", serialNumbers.size());
+    writer.field("successCount", successCount);
+    writer.field("failCount", failCount);
+    writer.end_object();
+    writer.end_record();
+    writer.finish();
+    httpd_resp_send_chunk(req, NULL, 0);
+
+    ESP_LOGI(TAG, "Group control completed: %d success, %d failed", successCount, failCount);
+    return ESP_OK;
+}
+
 /**
  * @brief Handler for PUT /lights - sets light state for all devices in a group.
  * Expects JSON body: {"group": "<groupName>", "light": {"brightness": <0-100>, "temperature": <143-344>}}
+ * With "?async=1", answers 202 once the commands are queued instead of
+ * waiting for the lights. With "?stream=1", reports each light as it
+ * finishes (see streamGroupControl()).
  */
 static esp_err_t handleControlLightGroup(httpd_req_t *req) {
     ServerContext* ctx = (ServerContext*)req->user_ctx;
@@ -323,70 +601,70 @@ static esp_err_t handleControlLightGroup(httpd_req_t *req) {
 
     ESP_LOGI(TAG, "Found %d devices in group '%s'", serialNumbers.size(), groupName.c_str());
 
-    // Control each light in the group
-    int successCount = 0;
-    int failCount = 0;
-    cJSON *results = cJSON_CreateArray();
-
+    // Resolve every serial to its light's current address, then update
+    // all of them at once
+    std::vector<std::optional<DeviceInfo>> devices;
+    std::vector<LightCommand> commands;
     for (const auto& serial : serialNumbers) {
-        // Look up device info by serial number
-        auto it = ctx->device_serial_map->find(serial);
-        if (it == ctx->device_serial_map->end()) {
-            ESP_LOGW(TAG, "Serial '%s' not found in device map", serial.c_str());
-            failCount++;
-
-            cJSON *result = cJSON_CreateObject();
-            cJSON_AddStringToObject(result, "serial", serial.c_str());
-            cJSON_AddBoolToObject(result, "success", false);
-            cJSON_AddStringToObject(result, "error", "Device not found");
-            cJSON_AddItemToArray(results, result);
-            continue;
+        std::optional<DeviceInfo> found = ctx->device_registry->find_by_serial(serial);
+        if (found) {
+            LightCommand command;
+            command.ip = found->ip;
+            command.brightness = brightness;
+            command.temperature = temperature;
+            commands.push_back(command);
         }
+        devices.push_back(found);
+    }
 
-        const DeviceInfo& deviceInfo = it->second;
-        ESP_LOGI(TAG, "Controlling light: %s (%s)", deviceInfo.displayName.c_str(), deviceInfo.ip.c_str());
+    if (queryFlag(req, "async")) {
+        return sendCommandsAccepted(req, ctx, commands, serialNumbers.size() - commands.size());
+    }
+    if (queryFlag(req, "stream")) {
+        return streamGroupControl(req, ctx, groupName, serialNumbers, devices, commands);
+    }
 
-        // Set light state
-        ElgatoLight light = setLight(deviceInfo.ip, brightness, temperature);
+    fanout_set_lights(commands, ctx->light_state);
 
+    // Count first: the totals come before the results
+    int successCount = 0;
+    int failCount = 0;
+    size_t next_command = 0;
+    for (size_t i = 0; i < serialNumbers.size(); ++i) {
+        if (!devices[i]) {
+            ESP_LOGW(TAG, "Serial '%s' not found in device map", serialNumbers[i].c_str());
+            failCount++;
+            continue;
+        }
+        const ElgatoLight& light = commands[next_command++].result;
         if (light.error.empty()) {
             successCount++;
-            ESP_LOGI(TAG, "Successfully controlled %s", deviceInfo.displayName.c_str());
-
-            cJSON *result = cJSON_CreateObject();
-            cJSON_AddStringToObject(result, "serial", serial.c_str());
-            cJSON_AddStringToObject(result, "displayName", deviceInfo.displayName.c_str());
-            cJSON_AddBoolToObject(result, "success", true);
-            cJSON_AddNumberToObject(result, "brightness", light.brightness);
-            cJSON_AddNumberToObject(result, "temperature", light.temperature);
-            cJSON_AddItemToArray(results, result);
+            ESP_LOGI(TAG, "Successfully controlled %s", devices[i]->displayName.c_str());
         } else {
             failCount++;
-            ESP_LOGW(TAG, "Failed to control %s: %s", deviceInfo.displayName.c_str(), light.error.c_str());
-
-            cJSON *result = cJSON_CreateObject();
-            cJSON_AddStringToObject(result, "serial", serial.c_str());
-            cJSON_AddStringToObject(result, "displayName", deviceInfo.displayName.c_str());
-            cJSON_AddBoolToObject(result, "success", false);
-            cJSON_AddStringToObject(result, "error", light.error.c_str());
-            cJSON_AddItemToArray(results, result);
+            ESP_LOGW(TAG, "Failed to control %s: %s", devices[i]->displayName.c_str(), light.error.c_str());
         }
     }
 
-    // Build response
-    cJSON *response = cJSON_CreateObject();
-    cJSON_AddStringToObject(response, "groupName", groupName.c_str());
-    cJSON_AddNumberToObject(response, "totalDevices", serialNumbers.size());
-    cJSON_AddNumberToObject(response, "successCount", successCount);
-    cJSON_AddNumberToObject(response, "failCount", failCount);
-    cJSON_AddItemToObject(response, "results", results);
-
-    char *json_str = cJSON_PrintUnformatted(response);
+    // Stream the response
     httpd_resp_set_type(req, "application/json");
-    httpd_resp_send(req, json_str, strlen(json_str));
-
-    cJSON_free(json_str);
-    cJSON_Delete(response);
+    JsonWriter writer(chunkedResponse(req));
+    writer.begin_object();
+    writer.field("groupName", groupName);
+    writer.field("totalDevices", serialNumbers.size());
+    writer.field("successCount", successCount);
+    writer.field("failCount", failCount);
+    writer.key("results");
+    writer.begin_array();
+    next_command = 0;
+    for (size_t i = 0; i < serialNumbers.size(); ++i) {
+        const LightCommand* command = devices[i] ? &commands[next_command++] : nullptr;
+        write_light_result(writer, serialNumbers[i], devices[i] ? &*devices[i] : nullptr, command, true);
+    }
+    writer.end_array();
+    writer.end_object();
+    writer.finish();
+    httpd_resp_send_chunk(req, NULL, 0);
 
     ESP_LOGI(TAG, "Group control completed: %d success, %d failed", successCount, failCount);
 
@@ -395,13 +673,15 @@ static esp_err_t handleControlLightGroup(httpd_req_t *req) {
 
 /**
  * @brief Handler for PUT /lights/off - turns off all known lights.
+ * Accepts "?async=1" like PUT /lights.
  */
 static esp_err_t handleLightsOff(httpd_req_t *req) {
     ServerContext* ctx = (ServerContext*)req->user_ctx;
 
     ESP_LOGI(TAG, "Received PUT /lights/off request");
 
-    if (ctx->device_map->empty()) {
+    std::vector<DeviceInfo> devices = ctx->device_registry->all();
+    if (devices.empty()) {
         ESP_LOGW(TAG, "No devices available to turn off");
         httpd_resp_set_status(req, "404 Not Found");
         httpd_resp_set_type(req, "application/json");
@@ -409,55 +689,50 @@ static esp_err_t handleLightsOff(httpd_req_t *req) {
         return ESP_OK;
     }
 
-    ESP_LOGI(TAG, "Turning off %d devices", ctx->device_map->size());
+    ESP_LOGI(TAG, "Turning off %d devices", devices.size());
 
-    // Turn off all lights
-    int successCount = 0;
-    int failCount = 0;
-    cJSON *results = cJSON_CreateArray();
+    // Set brightness to 0 without changing temperature, on every light at once
+    std::vector<LightCommand> commands(devices.size());
+    for (size_t i = 0; i < devices.size(); ++i) {
+        commands[i].ip = devices[i].ip;
+        commands[i].brightness = 0;
+    }
 
-    for (const auto& pair : *ctx->device_map) {
-        const DeviceInfo& deviceInfo = pair.second;
-        ESP_LOGI(TAG, "Turning off: %s (%s)", deviceInfo.displayName.c_str(), deviceInfo.ip.c_str());
+    if (queryFlag(req, "async")) {
+        return sendCommandsAccepted(req, ctx, commands, 0);
+    }
 
-        // Set brightness to 0 without changing temperature
-        ElgatoLight light = setLight(deviceInfo.ip, 0);
+    fanout_set_lights(commands, ctx->light_state);
 
+    int successCount = 0;
+    int failCount = 0;
+    for (size_t i = 0; i < devices.size(); ++i) {
+        const ElgatoLight& light = commands[i].result;
         if (light.error.empty()) {
             successCount++;
-            ESP_LOGI(TAG, "Successfully turned off %s", deviceInfo.displayName.c_str());
-
-            cJSON *result = cJSON_CreateObject();
-            cJSON_AddStringToObject(result, "serial", deviceInfo.serialNumber.c_str());
-            cJSON_AddStringToObject(result, "displayName", deviceInfo.displayName.c_str());
-            cJSON_AddBoolToObject(result, "success", true);
-            cJSON_AddItemToArray(results, result);
+            ESP_LOGI(TAG, "Successfully turned off %s", devices[i].displayName.c_str());
         } else {
             failCount++;
-            ESP_LOGW(TAG, "Failed to turn off %s: %s", deviceInfo.displayName.c_str(), light.error.c_str());
-
-            cJSON *result = cJSON_CreateObject();
-            cJSON_AddStringToObject(result, "serial", deviceInfo.serialNumber.c_str());
-            cJSON_AddStringToObject(result, "displayName", deviceInfo.displayName.c_str());
-            cJSON_AddBoolToObject(result, "success", false);
-            cJSON_AddStringToObject(result, "error", light.error.c_str());
-            cJSON_AddItemToArray(results, result);
+            ESP_LOGW(TAG, "Failed to turn off %s: %s", devices[i].displayName.c_str(), light.error.c_str());
         }
     }
 
-    // Build response
-    cJSON *response = cJSON_CreateObject();
-    cJSON_AddNumberToObject(response, "totalDevices", ctx->device_map->size());
-    cJSON_AddNumberToObject(response, "successCount", successCount);
-    cJSON_AddNumberToObject(response, "failCount", failCount);
-    cJSON_AddItemToObject(response, "results", results);
-
-    char *json_str = cJSON_PrintUnformatted(response);
+    // Stream the response
     httpd_resp_set_type(req, "application/json");
-    httpd_resp_send(req, json_str, strlen(json_str));
-
-    cJSON_free(json_str);
-    cJSON_Delete(response);
+    JsonWriter writer(chunkedResponse(req));
+    writer.begin_object();
+    writer.field("totalDevices", devices.size());
+    writer.field("successCount", successCount);
+    writer.field("failCount", failCount);
+    writer.key("results");
+    writer.begin_array();
+    for (size_t i = 0; i < devices.size(); ++i) {
+        write_light_result(writer, devices[i].serialNumber, &devices[i], &commands[i], false);
+    }
+    writer.end_array();
+    writer.end_object();
+    writer.finish();
+    httpd_resp_send_chunk(req, NULL, 0);
 
     ESP_LOGI(TAG, "Lights off completed: %d success, %d failed", successCount, failCount);
 
@@ -477,6 +752,24 @@ static void registerRoutes(httpd_handle_t server, ServerContext* ctx) {
     };
     httpd_register_uri_handler(server, &get_all_lights);
 
+    // GET /lights/state
+    httpd_uri_t get_light_states = {
+        .uri       = "/lights/state",
+        .method    = HTTP_GET,
+        .handler   = handleGetLightStates,
+        .user_ctx  = (void*)ctx
+    };
+    httpd_register_uri_handler(server, &get_light_states);
+
+    // GET /lights/health
+    httpd_uri_t get_light_health = {
+        .uri       = "/lights/health",
+        .method    = HTTP_GET,
+        .handler   = handleGetLightHealth,
+        .user_ctx  = (void*)ctx
+    };
+    httpd_register_uri_handler(server, &get_light_health);
+
     // GET /lights/group
     httpd_uri_t get_light_groups = {
         .uri       = "/lights/group",
@@ -516,41 +809,20 @@ static void registerRoutes(httpd_handle_t server, ServerContext* ctx) {
     ESP_LOGI(TAG, "Registered 9 routes");
 }
 
-/**
- * @brief Background task to update cached device JSON periodically.
- */
-void update_device_cache_task(void* pvParameters) {
-    auto* device_map = static_cast<const std::map<std::string, DeviceInfo>*>(pvParameters);
-
-    ESP_LOGI(TAG, "Device cache update task started");
-
-    while (1) {
-        std::string new_json = device_map_to_json(device_map);
-
-        if (xSemaphoreTake(server_cache->mutex, pdMS_TO_TICKS(1000)) == pdTRUE) {
-            server_cache->cached_devices_json = new_json;
-            xSemaphoreGive(server_cache->mutex);
-            ESP_LOGD(TAG, "Updated device cache (%d bytes)", new_json.length());
-        }
-
-        vTaskDelay(pdMS_TO_TICKS(2000)); // Update every 2 seconds
-    }
-}
-
 /**
  * @brief Starts the HTTP server on port 80.
  */
-httpd_handle_t http_server_start(const std::map<std::string, DeviceInfo>* device_map, const std::map<std::string, DeviceInfo>* device_serial_map, LightGroupCache* light_group_cache) {
+httpd_handle_t http_server_start(const DeviceRegistry* device_registry, LightGroupCache* light_group_cache,
+                                 LightStateMirror* light_state) {
     ESP_LOGI(TAG, "Starting HTTP server...");
 
-    // Initialize cache
-    server_cache = new ServerCache();
+    s_boot_tag = esp_random();
 
     // Create server context
     static ServerContext ctx;
-    ctx.device_map = device_map;
-    ctx.device_serial_map = device_serial_map;
+    ctx.device_registry = device_registry;
     ctx.light_group_cache = light_group_cache;
+    ctx.light_state = light_state;
 
     httpd_handle_t server = NULL;
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
@@ -572,17 +844,6 @@ httpd_handle_t http_server_start(const std::map<std::string, DeviceInfo>* device
 
     registerRoutes(server, &ctx);
 
-    // Start background task to update cache
-    xTaskCreatePinnedToCore(
-        update_device_cache_task,
-        "device_cache_updater",
-        4096,
-        (void*)device_map,
-        2,  // Lower priority than HTTP server
-        NULL,
-        0
-    );
-
     ESP_LOGI(TAG, "HTTP server listening on port 80");
     return server;
 }
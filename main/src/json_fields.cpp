@@ -0,0 +1,306 @@
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+
+#include "json_fields.h"
+
+static bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+// Characters that can continue a number, true, false or null
+static bool is_literal_char(char c) {
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           c == '-' || c == '+' || c == '.';
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+JsonFieldExtractor::JsonFieldExtractor(JsonField* fields, size_t count) : fields(fields), field_count(count) {}
+
+void JsonFieldExtractor::feed(const char* data, size_t len) {
+    for (size_t i = 0; i < len && state != State::FAILED; ++i) {
+        consume(data[i]);
+    }
+}
+
+bool JsonFieldExtractor::finish() {
+    // A bare top-level number has no delimiter after it
+    if (state == State::LITERAL && depth == 0) end_literal();
+    return state == State::DONE;
+}
+
+// Index of the wanted field at the current position, or -1.
+int JsonFieldExtractor::match_field() const {
+    if (depth == 0) return -1;
+
+    for (size_t i = 0; i < field_count; ++i) {
+        const JsonField &field = fields[i];
+        if (field.found) continue;
+
+        const char* p = field.path;
+        bool match = true;
+        for (size_t d = 0; d < depth && match; ++d) {
+            const char* end = strchr(p, '.');
+            size_t seg_len = end ? (size_t)(end - p) : strlen(p);
+            if (seg_len == 0 || (d + 1 < depth) != (end != nullptr)) {
+                match = false; // Path is shorter or longer than the current position
+                break;
+            }
+
+            const Frame &frame = frames[d];
+            if (frame.is_array) {
+                uint32_t index = 0;
+                for (size_t k = 0; k < seg_len && match; ++k) {
+                    if (p[k] < '0' || p[k] > '9') match = false;
+                    index = index * 10 + (p[k] - '0');
+                }
+                match = match && index == frame.index;
+            } else {
+                match = !frame.key_overflow && strlen(frame.key) == seg_len && memcmp(frame.key, p, seg_len) == 0;
+            }
+            p += seg_len + 1;
+        }
+        if (match) return (int)i;
+    }
+    return -1;
+}
+
+void JsonFieldExtractor::begin_value(char c) {
+    active_field = match_field();
+
+    if (c == '{' || c == '[') {
+        if (depth == MAX_DEPTH) {
+            state = State::FAILED;
+            return;
+        }
+        Frame &frame = frames[depth++];
+        frame.is_array = c == '[';
+        frame.index = 0;
+        frame.key[0] = '\0';
+        frame.key_overflow = false;
+        state = c == '{' ? State::KEY_OR_END : State::VALUE_OR_END;
+        return;
+    }
+
+    text_len = 0;
+    text_overflow = false;
+    if (c == '"') {
+        reading_key = false;
+        escape = false;
+        unicode_digits = 0;
+        high_surrogate = 0;
+        state = State::STRING;
+    } else if (c == '-' || (c >= '0' && c <= '9') || c == 't' || c == 'f' || c == 'n') {
+        text[text_len++] = c;
+        state = State::LITERAL;
+    } else {
+        state = State::FAILED;
+    }
+}
+
+void JsonFieldExtractor::end_value() {
+    state = depth == 0 ? State::DONE : State::AFTER_VALUE;
+}
+
+void JsonFieldExtractor::append_string_byte(char c) {
+    // Bytes of values nobody asked for are not kept
+    if (!reading_key && active_field < 0) return;
+    if (text_len < MAX_STRING) {
+        text[text_len++] = c;
+    } else {
+        text_overflow = true;
+    }
+}
+
+void JsonFieldExtractor::append_code_point(uint32_t cp) {
+    if (cp < 0x80) {
+        append_string_byte((char)cp);
+    } else if (cp < 0x800) {
+        append_string_byte((char)(0xC0 | (cp >> 6)));
+        append_string_byte((char)(0x80 | (cp & 0x3F)));
+    } else if (cp < 0x10000) {
+        append_string_byte((char)(0xE0 | (cp >> 12)));
+        append_string_byte((char)(0x80 | ((cp >> 6) & 0x3F)));
+        append_string_byte((char)(0x80 | (cp & 0x3F)));
+    } else {
+        append_string_byte((char)(0xF0 | (cp >> 18)));
+        append_string_byte((char)(0x80 | ((cp >> 12) & 0x3F)));
+        append_string_byte((char)(0x80 | ((cp >> 6) & 0x3F)));
+        append_string_byte((char)(0x80 | (cp & 0x3F)));
+    }
+}
+
+void JsonFieldExtractor::end_string() {
+    if (reading_key) {
+        Frame &frame = frames[depth - 1];
+        frame.key_overflow = text_overflow || text_len > MAX_KEY;
+        size_t n = frame.key_overflow ? 0 : text_len;
+        memcpy(frame.key, text, n);
+        frame.key[n] = '\0';
+        state = State::COLON;
+        return;
+    }
+
+    if (active_field >= 0 && fields[active_field].string_value) {
+        fields[active_field].string_value->assign(text, text_len);
+        fields[active_field].found = true;
+    }
+    end_value();
+}
+
+void JsonFieldExtractor::end_literal() {
+    text[text_len] = '\0';
+    bool is_number = text[0] == '-' || (text[0] >= '0' && text[0] <= '9');
+
+    if (is_number) {
+        char* end = nullptr;
+        double value = strtod(text, &end);
+        if (text_overflow || end != text + text_len) {
+            state = State::FAILED;
+            return;
+        }
+        if (active_field >= 0 && fields[active_field].int_value) {
+            if (value >= INT_MAX) {
+                *fields[active_field].int_value = INT_MAX;
+            } else if (value <= INT_MIN) {
+                *fields[active_field].int_value = INT_MIN;
+            } else {
+                *fields[active_field].int_value = (int)value;
+            }
+            fields[active_field].found = true;
+        }
+    } else if (strcmp(text, "true") != 0 && strcmp(text, "false") != 0 && strcmp(text, "null") != 0) {
+        state = State::FAILED;
+        return;
+    }
+    end_value();
+}
+
+void JsonFieldExtractor::consume(char c) {
+    switch (state) {
+    case State::STRING:
+        if (unicode_digits > 0) {
+            int digit = hex_value(c);
+            if (digit < 0) {
+                state = State::FAILED;
+                return;
+            }
+            unicode_value = (unicode_value << 4) | digit;
+            if (--unicode_digits > 0) return;
+
+            uint32_t cp = unicode_value;
+            if (cp >= 0xD800 && cp <= 0xDBFF) {
+                high_surrogate = cp; // Wait for the low half
+                return;
+            }
+            if (cp >= 0xDC00 && cp <= 0xDFFF && high_surrogate) {
+                cp = 0x10000 + ((high_surrogate - 0xD800) << 10) + (cp - 0xDC00);
+            }
+            high_surrogate = 0;
+            append_code_point(cp);
+        } else if (escape) {
+            escape = false;
+            switch (c) {
+            case '"': case '\\': case '/': append_string_byte(c); break;
+            case 'b': append_string_byte('\b'); break;
+            case 'f': append_string_byte('\f'); break;
+            case 'n': append_string_byte('\n'); break;
+            case 'r': append_string_byte('\r'); break;
+            case 't': append_string_byte('\t'); break;
+            case 'u': unicode_digits = 4; unicode_value = 0; break;
+            default: state = State::FAILED; break;
+            }
+        } else if (c == '\\') {
+            escape = true;
+        } else if (c == '"') {
+            end_string();
+        } else if ((unsigned char)c < 0x20) {
+            state = State::FAILED;
+        } else {
+            append_string_byte(c);
+        }
+        return;
+
+    case State::LITERAL:
+        if (is_literal_char(c)) {
+            if (text_len < MAX_STRING) {
+                text[text_len++] = c;
+            } else {
+                text_overflow = true;
+            }
+            return;
+        }
+        end_literal();
+        if (state != State::FAILED) consume(c); // The delimiter belongs to the enclosing container
+        return;
+
+    default:
+        break;
+    }
+
+    if (is_space(c)) return;
+
+    switch (state) {
+    case State::VALUE_OR_END:
+        if (c == ']') {
+            depth--;
+            end_value();
+            return;
+        }
+        begin_value(c);
+        return;
+
+    case State::VALUE:
+        begin_value(c);
+        return;
+
+    case State::KEY_OR_END:
+        if (c == '}') {
+            depth--;
+            end_value();
+            return;
+        }
+        // fall through
+    case State::KEY:
+        if (c != '"') {
+            state = State::FAILED;
+            return;
+        }
+        reading_key = true;
+        escape = false;
+        unicode_digits = 0;
+        high_surrogate = 0;
+        text_len = 0;
+        text_overflow = false;
+        state = State::STRING;
+        return;
+
+    case State::COLON:
+        state = c == ':' ? State::VALUE : State::FAILED;
+        return;
+
+    case State::AFTER_VALUE: {
+        bool in_array = frames[depth - 1].is_array;
+        if (c == ',') {
+            if (in_array) frames[depth - 1].index++;
+            state = in_array ? State::VALUE : State::KEY;
+        } else if ((c == ']' && in_array) || (c == '}' && !in_array)) {
+            depth--;
+            end_value();
+        } else {
+            state = State::FAILED;
+        }
+        return;
+    }
+
+    default:
+        state = State::FAILED; // Anything after the top-level value
+        return;
+    }
+}
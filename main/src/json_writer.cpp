@@ -0,0 +1,131 @@
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+#include "json_writer.h"
+
+JsonWriter::JsonWriter(JsonWriterFlush flush) : flush_output(std::move(flush)) {}
+
+bool JsonWriter::flush() {
+    if (used > 0 && !failed_flush) {
+        failed_flush = !flush_output(buffer, used);
+    }
+    used = 0;
+    return !failed_flush;
+}
+
+void JsonWriter::put(char c) {
+    if (used == BUFFER_SIZE) flush();
+    buffer[used++] = c;
+}
+
+void JsonWriter::put(const char* data, size_t len) {
+    while (len > 0) {
+        if (used == BUFFER_SIZE) flush();
+        size_t n = std::min(len, BUFFER_SIZE - used);
+        memcpy(buffer + used, data, n);
+        used += n;
+        data += n;
+        len -= n;
+    }
+}
+
+void JsonWriter::put_escaped(const char* value) {
+    put('"');
+    for (const char* p = value; *p; ++p) {
+        unsigned char c = (unsigned char)*p;
+        switch (c) {
+        case '"': put("\\\"", 2); break;
+        case '\\': put("\\\\", 2); break;
+        case '\b': put("\\b", 2); break;
+        case '\f': put("\\f", 2); break;
+        case '\n': put("\\n", 2); break;
+        case '\r': put("\\r", 2); break;
+        case '\t': put("\\t", 2); break;
+        default:
+            if (c < 0x20) {
+                char escaped[7];
+                snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                put(escaped, 6);
+            } else {
+                put((char)c);
+            }
+            break;
+        }
+    }
+    put('"');
+}
+
+// Separate this value from the previous one at the same level.
+void JsonWriter::begin_value() {
+    if (need_comma) put(',');
+    need_comma = true;
+}
+
+void JsonWriter::begin_object() {
+    begin_value();
+    put('{');
+    need_comma = false;
+}
+
+void JsonWriter::end_object() {
+    put('}');
+    need_comma = true;
+}
+
+void JsonWriter::begin_array() {
+    begin_value();
+    put('[');
+    need_comma = false;
+}
+
+void JsonWriter::end_array() {
+    put(']');
+    need_comma = true;
+}
+
+void JsonWriter::key(const char* name) {
+    begin_value();
+    put_escaped(name);
+    put(':');
+    need_comma = false; // The value belongs to this key
+}
+
+void JsonWriter::string(const char* value) {
+    begin_value();
+    put_escaped(value);
+}
+
+void JsonWriter::number(int64_t value) {
+    begin_value();
+    char digits[24];
+    int len = snprintf(digits, sizeof(digits), "%" PRId64, value);
+    put(digits, len);
+}
+
+void JsonWriter::boolean(bool value) {
+    begin_value();
+    if (value) {
+        put("true", 4);
+    } else {
+        put("false", 5);
+    }
+}
+
+void JsonWriter::null() {
+    begin_value();
+    put("null", 4);
+}
+
+void JsonWriter::end_record() {
+    put('\n');
+    need_comma = false;
+}
+
+JsonWriterFlush json_writer_to_string(std::string &out) {
+    return [&out](const char *data, size_t len) {
+        out.append(data, len);
+        return true;
+    };
+}
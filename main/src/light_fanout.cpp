@@ -0,0 +1,121 @@
+#include <atomic>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+
+#include "light_fanout.h"
+
+static const char* TAG = "LIGHT_FANOUT";
+
+static std::atomic<uint32_t> s_async_queued{0};
+static std::atomic<uint32_t> s_async_succeeded{0};
+static std::atomic<uint32_t> s_async_failed{0};
+
+// Commands for lights the mirror does not already show in the requested state.
+// A light with an update in flight or queued is always sent the command: the
+// mirror only knows where it was, not where the other update will leave it,
+// and the command has to land after that update for the latest to win.
+static std::vector<LightCommand*> commands_to_send(std::vector<LightCommand> &commands, LightStateMirror* mirror) {
+    std::vector<LightCommand*> to_send;
+    for (auto &command : commands) {
+        if (mirror && mirror->matches(command.ip, command.brightness, command.temperature) &&
+            !lightUpdatePending(command.ip)) {
+            std::optional<MirroredLight> known = mirror->get(command.ip);
+            if (known) {
+                command.result = known->state;
+                command.skipped = true;
+                ESP_LOGD(TAG, "%s already at brightness %d, skipping", command.ip.c_str(), command.brightness);
+                continue;
+            }
+        }
+        to_send.push_back(&command);
+    }
+    return to_send;
+}
+
+// Record a finished command in the mirror and pass it on.
+static void command_done(LightCommand &command, LightStateMirror* mirror, const FanoutResultCallback &on_result) {
+    if (mirror && !command.skipped) {
+        if (command.result.error.empty()) {
+            mirror->record(command.ip, command.result, true);
+        } else {
+            mirror->record_failure(command.ip);
+        }
+    }
+    if (on_result) on_result(command);
+}
+
+void fanout_set_lights(std::vector<LightCommand> &commands, LightStateMirror* mirror,
+                       FanoutResultCallback on_result) {
+    std::vector<LightCommand*> to_send = commands_to_send(commands, mirror);
+    for (auto &command : commands) {
+        if (command.skipped) command_done(command, mirror, on_result);
+    }
+    if (to_send.empty()) return;
+
+    QueueHandle_t done = xQueueCreate(to_send.size(), sizeof(LightCommand*));
+    if (!done) {
+        // Nothing to wait on; fall back to one light at a time
+        ESP_LOGW(TAG, "Running %d commands sequentially", (int)to_send.size());
+        for (LightCommand* command : to_send) {
+            command->result = setLight(command->ip, command->brightness, command->temperature);
+            command_done(*command, mirror, on_result);
+        }
+        return;
+    }
+
+    // `commands` outlives every callback: this function does not return
+    // until each one has reported back through the queue
+    for (LightCommand* command : to_send) {
+        setLightAsync(command->ip, command->brightness, command->temperature, [command, done](const ElgatoLight &light) {
+            command->result = light;
+            xQueueSend(done, &command, portMAX_DELAY);
+        });
+    }
+
+    // Every command calls back exactly once; handle them in completion order
+    for (size_t i = 0; i < to_send.size(); ++i) {
+        LightCommand* command;
+        xQueueReceive(done, &command, portMAX_DELAY);
+        command_done(*command, mirror, on_result);
+    }
+    vQueueDelete(done);
+}
+
+size_t fanout_set_lights_async(std::vector<LightCommand> &commands, LightStateMirror* mirror) {
+    std::vector<LightCommand*> to_send = commands_to_send(commands, mirror);
+
+    for (LightCommand* command : to_send) {
+        s_async_queued++;
+        std::string ip = command->ip;
+        setLightAsync(ip, command->brightness, command->temperature, [ip, mirror](const ElgatoLight &light) {
+            if (!light.error.empty()) {
+                s_async_failed++;
+                if (mirror) mirror->record_failure(ip);
+                return;
+            }
+            s_async_succeeded++;
+            if (!mirror) return;
+
+            // Unless a coalesced caller had the state read, the result holds
+            // the command that was sent, which may have carried another
+            // caller's temperature. With none (0), keep the one last known.
+            ElgatoLight state = light;
+            if (state.temperature == 0) {
+                std::optional<MirroredLight> known = mirror->get(ip);
+                if (known && known->known) state.temperature = known->state.temperature;
+            }
+            mirror->record(ip, state, true);
+        }, false);
+    }
+    return to_send.size();
+}
+
+FanoutAsyncStats fanout_async_stats() {
+    FanoutAsyncStats stats;
+    stats.queued = s_async_queued;
+    stats.succeeded = s_async_succeeded;
+    stats.failed = s_async_failed;
+    return stats;
+}
@@ -0,0 +1,214 @@
+#include <algorithm>
+#include <climits>
+#include <set>
+
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "light_state.h"
+
+static const char* TAG = "LIGHT_STATE";
+
+static const int64_t ACTIVE_INTERVAL_US = (int64_t)LIGHT_POLL_ACTIVE_MS * 1000;
+static const int64_t ACTIVE_WINDOW_US = (int64_t)LIGHT_ACTIVE_WINDOW_MS * 1000;
+static const int64_t IDLE_MAX_INTERVAL_US = (int64_t)LIGHT_POLL_IDLE_MAX_MS * 1000;
+static const int64_t TRUST_US = (int64_t)LIGHT_STATE_TRUST_MS * 1000;
+
+// Polls share the lights' connections with commands, so only one runs at a time
+static const int MAX_POLLS_IN_FLIGHT = 1;
+
+static bool same_state(const ElgatoLight &a, const ElgatoLight &b) {
+    return a.on == b.on && a.brightness == b.brightness && a.temperature == b.temperature;
+}
+
+LightStateMirror::LightStateMirror() {
+    mutex = xSemaphoreCreateMutex();
+}
+
+// Pick the next poll time: fast while active, then back off. Caller holds the mutex.
+void LightStateMirror::schedule_locked(Entry &entry, int64_t now_us) {
+    if (now_us - entry.touched_us < ACTIVE_WINDOW_US) {
+        entry.interval_us = ACTIVE_INTERVAL_US;
+    } else {
+        entry.interval_us = std::min(std::max(entry.interval_us, ACTIVE_INTERVAL_US) * 2, IDLE_MAX_INTERVAL_US);
+    }
+    entry.next_poll_us = now_us + entry.interval_us;
+}
+
+void LightStateMirror::record(const std::string &ip, const ElgatoLight &state, bool commanded) {
+    int64_t now = esp_timer_get_time();
+    xSemaphoreTake(mutex, portMAX_DELAY);
+
+    Entry &entry = lights[ip];
+    if (commanded) {
+        entry.touched_us = now;
+    } else if (entry.light.known && !same_state(entry.light.state, state)) {
+        ESP_LOGI(TAG, "%s changed elsewhere: on=%d brightness=%d temperature=%d", ip.c_str(),
+                 state.on, state.brightness, state.temperature);
+        entry.touched_us = now;
+    }
+
+    entry.light.state = state;
+    entry.light.state.error.clear();
+    entry.light.known = true;
+    entry.light.reachable = true;
+    entry.light.confirmed_us = now;
+
+    if (!commanded && entry.polling) {
+        entry.polling = false;
+        polls_in_flight--;
+    }
+    schedule_locked(entry, now);
+
+    xSemaphoreGive(mutex);
+}
+
+void LightStateMirror::record_failure(const std::string &ip) {
+    int64_t now = esp_timer_get_time();
+    xSemaphoreTake(mutex, portMAX_DELAY);
+
+    auto it = lights.find(ip);
+    if (it != lights.end()) {
+        Entry &entry = it->second;
+        entry.light.reachable = false;
+        if (entry.polling) {
+            entry.polling = false;
+            polls_in_flight--;
+        }
+        schedule_locked(entry, now);
+    }
+
+    xSemaphoreGive(mutex);
+}
+
+bool LightStateMirror::matches(const std::string &ip, int brightness, std::optional<int> temperature) const {
+    int64_t now = esp_timer_get_time();
+    bool match = false;
+    xSemaphoreTake(mutex, portMAX_DELAY);
+
+    auto it = lights.find(ip);
+    if (it != lights.end()) {
+        const MirroredLight &light = it->second.light;
+        if (light.known && light.reachable && now - light.confirmed_us < TRUST_US) {
+            if (brightness == 0) {
+                match = light.state.on == 0;
+            } else {
+                match = light.state.on == 1 && light.state.brightness == brightness &&
+                        (!temperature.has_value() || light.state.temperature == temperature.value());
+            }
+        }
+    }
+
+    xSemaphoreGive(mutex);
+    return match;
+}
+
+std::optional<MirroredLight> LightStateMirror::get(const std::string &ip) const {
+    std::optional<MirroredLight> found;
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    auto it = lights.find(ip);
+    if (it != lights.end()) found = it->second.light;
+    xSemaphoreGive(mutex);
+    return found;
+}
+
+void LightStateMirror::track(const std::vector<std::string> &ips) {
+    std::set<std::string> wanted(ips.begin(), ips.end());
+    xSemaphoreTake(mutex, portMAX_DELAY);
+
+    for (auto it = lights.begin(); it != lights.end();) {
+        // An entry with a poll running is kept until the poll reports back
+        if (!wanted.count(it->first) && !it->second.polling) {
+            it = lights.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    for (const auto &ip : wanted) {
+        lights.emplace(ip, Entry()); // New entries are due immediately
+    }
+
+    xSemaphoreGive(mutex);
+}
+
+bool LightStateMirror::next_to_poll(int64_t now_us, std::string &ip) {
+    bool found = false;
+    xSemaphoreTake(mutex, portMAX_DELAY);
+
+    if (polls_in_flight < MAX_POLLS_IN_FLIGHT) {
+        Entry* due = nullptr;
+        for (auto &entry : lights) {
+            if (!entry.second.polling && entry.second.next_poll_us <= now_us &&
+                (!due || entry.second.next_poll_us < due->next_poll_us)) {
+                due = &entry.second;
+                ip = entry.first;
+            }
+        }
+        if (due) {
+            due->polling = true;
+            polls_in_flight++;
+            found = true;
+        }
+    }
+
+    xSemaphoreGive(mutex);
+    return found;
+}
+
+int64_t LightStateMirror::next_poll_us() const {
+    int64_t next = INT64_MAX;
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    for (const auto &entry : lights) {
+        if (!entry.second.polling) next = std::min(next, entry.second.next_poll_us);
+    }
+    xSemaphoreGive(mutex);
+    return next;
+}
+
+struct PollerContext {
+    const DeviceRegistry* device_registry;
+    LightStateMirror* mirror;
+};
+
+static void light_poller_task(void* pvParameters) {
+    auto* ctx = static_cast<PollerContext*>(pvParameters);
+    LightStateMirror* mirror = ctx->mirror;
+
+    ESP_LOGI(TAG, "Light poller started");
+
+    while (1) {
+        std::vector<std::string> ips;
+        for (const auto &info : ctx->device_registry->all()) {
+            if (!info.ip.empty()) ips.push_back(info.ip);
+        }
+        mirror->track(ips);
+
+        std::string ip;
+        while (mirror->next_to_poll(esp_timer_get_time(), ip)) {
+            getLightAsync(ip, [mirror, ip](const ElgatoLight &light) {
+                if (light.error.empty()) {
+                    mirror->record(ip, light, false);
+                } else {
+                    mirror->record_failure(ip);
+                }
+            });
+        }
+
+        // Wake for the next due poll, and at least once a second to pick up
+        // new lights and finished polls
+        int64_t wait_us = mirror->next_poll_us() - esp_timer_get_time();
+        wait_us = std::max<int64_t>(std::min<int64_t>(wait_us, 1000000), 10000);
+        vTaskDelay(pdMS_TO_TICKS(wait_us / 1000));
+    }
+}
+
+void light_poller_start(const DeviceRegistry* device_registry, LightStateMirror* mirror) {
+    static PollerContext ctx;
+    ctx.device_registry = device_registry;
+    ctx.mirror = mirror;
+
+    if (xTaskCreatePinnedToCore(light_poller_task, "light_poller", 4096, &ctx, 3, NULL, 0) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create light poller task");
+    }
+}
@@ -2,6 +2,8 @@
 #include <map>
 #include <vector>
 #include <set>
+#include <optional>
+#include <climits>
 #include <algorithm>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
@@ -10,6 +12,7 @@
 #include "esp_wifi.h"
 #include "esp_event.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "esp_netif.h"
 #include "nvs_flash.h"
 #include "driver/gpio.h"
@@ -21,7 +24,12 @@
 #include "mdns_socket.h"
 #include "http_requester.h"
 #include "http_server.h"
+#include "http_engine.h"
 #include "cache_lights.h"
+#include "discovery_cache.h"
+#include "device_registry.h"
+#include "light_state.h"
+#include "light_fanout.h"
 
 // Ensure TaskConfiguration is declared
 // If not present in mdns_socket.h, uncomment the forward declaration below:
@@ -43,76 +51,122 @@ struct NetworkConfig {
 static NetworkConfig* net_config = new NetworkConfig();
 
 struct LightsCache {
-    std::set<std::string> discovered_elgato_device_ips;
-    std::map<std::string, DeviceInfo> device_ip_to_info_map;
-    std::map<std::string, DeviceInfo> device_serial_to_info_map;
+    DiscoveryCache discovery_cache;
+    DeviceRegistry device_registry;
+    LightStateMirror light_state;
 
     LightGroupCache light_group_cache;
 };
 static LightsCache* lights_cache = new LightsCache();
 
-template <typename KeyType, typename ValueType>
-std::set<KeyType> get_map_keys(const std::map<KeyType, ValueType>& input_map) {
-    std::set<KeyType> keys;
-    for (const auto& pair : input_map) {
-        keys.insert(pair.first);
-    }
-    return keys;
-}
-
 void mdns_socket_task_wrapper(void* pvParameters) {
     NetworkConfig* net_config = static_cast<NetworkConfig*>(pvParameters);
     ESP_LOGI(TAG, "mDNS watcher task started");
-    while (1) {
-        // Unified task handles both service discovery responses AND query responses
-        mdns_socket_task(net_config->mdns_sock, net_config->qname_elgato, lights_cache->discovered_elgato_device_ips, net_config->mdns_hostname, net_config->wifi_ip);
 
-        vTaskDelay(pdMS_TO_TICKS(100));
+    static TaskConfiguration task_config;
+    task_config.sock_mdns = net_config->mdns_sock;
+    task_config.discovery_cache = &lights_cache->discovery_cache;
+    task_config.qname = net_config->qname_elgato;
+    task_config.mdns_hostname = net_config->mdns_hostname;
+    task_config.our_ip = net_config->wifi_ip;
+    task_config.prepare();
+
+    // Runs discovery, query responses and the announce/query timers; never returns
+    mdns_socket_run(task_config);
+}
+
+// Fetch /elgato/accessory-info for one device registered from mDNS and fill
+// in the fields mDNS does not carry (serial number, firmware, board).
+void enrich_next_device() {
+    std::string id;
+    std::string ip;
+    if (!lights_cache->device_registry.next_to_enrich(esp_timer_get_time(), id, ip)) return;
+
+    DeviceInfo info = sendHttpGetRequest(ip, 9123, "/elgato/accessory-info");
+    if (!info.error.empty()) {
+        ESP_LOGW(TAG, "Failed to enrich %s: %s", ip.c_str(), info.error.c_str());
+        lights_cache->device_registry.enrichment_failed(id, esp_timer_get_time());
+        return;
     }
+
+    lights_cache->device_registry.set_info(id, info);
+    ESP_LOGI(TAG, "Enriched device: %s (%s)", info.serialNumber.c_str(), ip.c_str());
 }
 
-void spam_mdns_announcements(void* pvParameters) {
-    NetworkConfig* net_config = static_cast<NetworkConfig*>(pvParameters);
-    ESP_LOGI(TAG, "mDNS announcement task started");
-    while (1) {
-        ESP_LOGI(TAG, "Sending mDNS announcement for %s", net_config->mdns_hostname.c_str());
-        send_mdns_announcement(net_config->mdns_sock, "_http._tcp.local", "ESP32 Elgato Light Control", net_config->mdns_hostname, net_config->wifi_ip, 80, {});
-        send_mdns_a_record(net_config->mdns_sock, net_config->mdns_hostname, net_config->wifi_ip);
-        send_mdns_ptr_query(net_config->mdns_sock, net_config->qname_elgato);
+// Register a light that resolves over mDNS but has not (yet) described its
+// service, by fetching its accessory-info directly.
+void register_by_address(const std::string& ip) {
+    ESP_LOGI(TAG, "Getting light data for %s", ip.c_str());
+    DeviceInfo info = sendHttpGetRequest(ip, 9123, "/elgato/accessory-info");
+
+    if (info.error.empty()) {
+        lights_cache->device_registry.upsert_info(info);
+        ESP_LOGI(TAG, "Successfully added device: %s", info.serialNumber.c_str());
+    } else {
+        ESP_LOGW(TAG, "Failed to get info for %s: %s", ip.c_str(), info.error.c_str());
+    }
+}
 
-        vTaskDelay(pdMS_TO_TICKS(30000)); // Announce every 10 seconds
+// Apply one discovery event to the device registry.
+void handle_discovery_event(const DiscoveryEvent& event) {
+    std::string ip = event.ip;
+    if (event.type == DiscoveryEvent::DEVICE_EXPIRED) {
+        lights_cache->device_registry.retire_address(ip);
+        return;
+    }
+
+    // Lights that advertised SRV/TXT are usable straight away and are
+    // matched by identity, so a new lease moves the existing entry. The
+    // accessory-info fetch happens afterwards. The mDNS task records a
+    // packet's SRV/TXT before its A records, so these are already in the
+    // cache when DEVICE_NEW arrives.
+    std::optional<DiscoveredDevice> device = lights_cache->discovery_cache.live_device(ip);
+    if (device) {
+        lights_cache->device_registry.upsert_discovered(*device);
+    } else if (!lights_cache->device_registry.has_address(ip)) {
+        register_by_address(ip);
+    }
+}
+
+// Events were dropped: rebuild the registry's view from the cache.
+void resync_devices() {
+    ESP_LOGW(TAG, "Discovery events overflowed, resynchronizing");
+    std::set<std::string> discovered_ips = lights_cache->discovery_cache.live_ips();
+    std::map<std::string, DiscoveredDevice> discovered_devices = lights_cache->discovery_cache.live_devices();
+
+    for (const auto& pair : discovered_devices) {
+        lights_cache->device_registry.upsert_discovered(pair.second);
+    }
+    for (const DeviceInfo& info : lights_cache->device_registry.all()) {
+        if (!discovered_ips.count(info.ip)) lights_cache->device_registry.retire_address(info.ip);
+    }
+    for (const std::string& ip : discovered_ips) {
+        if (discovered_devices.count(ip) || lights_cache->device_registry.has_address(ip)) continue;
+        register_by_address(ip);
     }
 }
 
+// Hydration task: blocks on the discovery event queue, so it costs nothing
+// while the network is quiet and reacts as soon as a light is seen. Wakes
+// on its own only when an enrichment retry is due.
 void process_ips(void* pvParameters) {
+    DiscoveryEvent event;
     while (1) {
-        std::set<std::string> known_devices = get_map_keys(lights_cache->device_ip_to_info_map);
-        std::vector<std::string> needed_ids;
-        std::set_difference(
-            lights_cache->discovered_elgato_device_ips.begin(), lights_cache->discovered_elgato_device_ips.end(),
-            known_devices.begin(), known_devices.end(),
-            std::back_inserter(needed_ids)
-        );
-
-        if (!needed_ids.empty()) {
-            ESP_LOGI(TAG, "Found %d new devices to query", needed_ids.size());
+        TickType_t wait = portMAX_DELAY;
+        int64_t next_enrichment = lights_cache->device_registry.next_enrichment_us();
+        if (next_enrichment != INT64_MAX) {
+            int64_t wait_us = next_enrichment - esp_timer_get_time();
+            wait = wait_us > 0 ? pdMS_TO_TICKS(wait_us / 1000 + 1) : 0;
         }
 
-        for (const std::string& item : needed_ids) {
-            ESP_LOGI(TAG, "Getting light data for %s", item.c_str());
-            vTaskDelay(pdMS_TO_TICKS(100));
-            DeviceInfo info = sendHttpGetRequest(item, 9123, "/elgato/accessory-info");
-
-            if (info.error.empty()) {
-                lights_cache->device_ip_to_info_map[item] = info;
-                lights_cache->device_serial_to_info_map[info.serialNumber] = info;
-                ESP_LOGI(TAG, "Successfully added device: %s", info.serialNumber.c_str());
-            } else {
-                ESP_LOGW(TAG, "Failed to get info for %s: %s", item.c_str(), info.error.c_str());
-            }
+        if (lights_cache->discovery_cache.wait_event(event, wait)) {
+            handle_discovery_event(event);
+        }
+        if (lights_cache->discovery_cache.take_overflow()) {
+            resync_devices();
         }
 
-        vTaskDelay(pdMS_TO_TICKS(500));
+        enrich_next_device();
     }
 }
 
@@ -199,21 +253,26 @@ void app_main(void) {
 
     // 5. Create the mDNS socket
     ESP_LOGI(TAG, "Setting up mDNS socket...");
-    net_config->mdns_sock = mdns_setup_socket();
+    net_config->mdns_sock = mdns_setup_socket(net_config->wifi_ip);
     ESP_LOGI(TAG, "mDNS socket created successfully");
 
     // Prepare task configuration and provide a pointer to the shared set so
     // the mdns task updates `s_discovered_mdns_ips` directly.
-    ESP_LOGI(TAG, "Creating mDNS tasks...");
+    ESP_LOGI(TAG, "Creating mDNS task...");
     if (xTaskCreatePinnedToCore(mdns_socket_task_wrapper, "mdns_watcher_task", 4096, net_config, 4, NULL, 0) != pdPASS) {
         ESP_LOGE(TAG, "Failed to create mDNS watcher task");
         stall_app();
     }
-    if (xTaskCreatePinnedToCore(spam_mdns_announcements, "mdns_announcements", 4096, net_config, 9, NULL, 0) != pdPASS) {
-        ESP_LOGE(TAG, "Failed to create mDNS announcement task");
+    ESP_LOGI(TAG, "mDNS task created successfully");
+
+    // Every request to the lights goes through the HTTP engine
+    if (!http_engine_start()) {
+        ESP_LOGE(TAG, "Failed to start HTTP engine");
         stall_app();
     }
-    ESP_LOGI(TAG, "mDNS tasks created successfully");
+    // Hedging duplicates slow light commands on a second connection; opt in
+    // with LIGHT_HEDGING=1
+    http_engine_set_hedging(get_nvs_string_value("LIGHT_HEDGING") == "1");
 
     if (xTaskCreatePinnedToCore(process_ips, "process_ips", 8192, NULL, 7, NULL, 0) != pdPASS) {
         ESP_LOGE(TAG, "Failed to create IP resolution task");
@@ -221,9 +280,13 @@ void app_main(void) {
     }
     ESP_LOGI(TAG, "IP resolution task created successfully");
 
+    // Keep the light state mirror current
+    light_poller_start(&lights_cache->device_registry, &lights_cache->light_state);
+
     // 6. Start HTTP server
     ESP_LOGI(TAG, "Starting HTTP server...");
-    static httpd_handle_t http_server = http_server_start(&lights_cache->device_ip_to_info_map, &lights_cache->device_serial_to_info_map, &lights_cache->light_group_cache);
+    static httpd_handle_t http_server = http_server_start(&lights_cache->device_registry, &lights_cache->light_group_cache,
+                                                          &lights_cache->light_state);
     if (http_server == NULL) {
         ESP_LOGE(TAG, "HTTP server failed to start - halting");
         stall_app();
@@ -233,9 +296,20 @@ void app_main(void) {
     ESP_LOGI(TAG, "Entering main loop - monitoring for Elgato devices");
     while (1) {
 
-        ESP_LOGI(TAG, "Devices: %d, Free heap: %lu bytes", 
-                lights_cache->device_ip_to_info_map.size(),
-                esp_get_free_heap_size());
+        MdnsStats mdns_stats = mdns_get_stats();
+        ESP_LOGI(TAG, "Devices: %d, Free heap: %lu bytes, mDNS packets: %lu (max %lu/wakeup, drain cap hit %lu, dropped %lu, rate limited %lu, answers deferred %lu)", 
+                lights_cache->device_registry.size(),
+                esp_get_free_heap_size(),
+                mdns_stats.packets, mdns_stats.max_packets_per_wakeup, mdns_stats.drain_cap_hits,
+                mdns_stats.dropped_malformed,
+                mdns_stats.dropped_rate_limited + mdns_stats.responses_rate_limited,
+                mdns_stats.responses_deferred);
+        FanoutAsyncStats async_stats = fanout_async_stats();
+        if (async_stats.queued > 0) {
+            ESP_LOGI(TAG, "Fire-and-forget commands: %lu queued, %lu succeeded, %lu failed",
+                     (unsigned long)async_stats.queued, (unsigned long)async_stats.succeeded,
+                     (unsigned long)async_stats.failed);
+        }
 
         vTaskDelay(pdMS_TO_TICKS(1000));
     }
@@ -0,0 +1,337 @@
+#include <cctype>
+#include <cstring>
+
+#include "mdns_packet.h"
+
+// Split the next label off a dotted name. Returns false once the name is
+// exhausted. Empty labels (leading, doubled or trailing dots) are skipped.
+static bool next_label(std::string_view &rest, std::string_view &label) {
+    while (!rest.empty()) {
+        size_t dot = rest.find('.');
+        if (dot == std::string_view::npos) {
+            label = rest;
+            rest = std::string_view();
+        } else {
+            label = rest.substr(0, dot);
+            rest = rest.substr(dot + 1);
+        }
+        if (!label.empty()) return true;
+    }
+    return false;
+}
+
+static bool label_equals(const uint8_t* wire, std::string_view label) {
+    for (size_t i = 0; i < label.size(); ++i) {
+        if (std::tolower(wire[i]) != std::tolower((unsigned char)label[i])) return false;
+    }
+    return true;
+}
+
+MdnsPacketWriter::MdnsPacketWriter(uint8_t* buf, size_t capacity)
+    : buf_(buf), cap_(capacity) {}
+
+bool MdnsPacketWriter::reserve(size_t n) {
+    if (overflow_ || len_ + n > cap_) {
+        overflow_ = true;
+        return false;
+    }
+    return true;
+}
+
+void MdnsPacketWriter::header(uint16_t flags, uint16_t qdcount, uint16_t ancount, uint16_t nscount, uint16_t arcount) {
+    put_u16(0); // ID
+    put_u16(flags);
+    put_u16(qdcount);
+    put_u16(ancount);
+    put_u16(nscount);
+    put_u16(arcount);
+}
+
+void MdnsPacketWriter::put_u8(uint8_t val) {
+    if (!reserve(1)) return;
+    buf_[len_++] = val;
+}
+
+void MdnsPacketWriter::put_u16(uint16_t val) {
+    if (!reserve(2)) return;
+    buf_[len_++] = (val >> 8) & 0xFF;
+    buf_[len_++] = val & 0xFF;
+}
+
+void MdnsPacketWriter::put_u32(uint32_t val) {
+    if (!reserve(4)) return;
+    buf_[len_++] = (val >> 24) & 0xFF;
+    buf_[len_++] = (val >> 16) & 0xFF;
+    buf_[len_++] = (val >> 8) & 0xFF;
+    buf_[len_++] = val & 0xFF;
+}
+
+void MdnsPacketWriter::put_bytes(const void* data, size_t len) {
+    if (!reserve(len)) return;
+    memcpy(buf_ + len_, data, len);
+    len_ += len;
+}
+
+void MdnsPacketWriter::patch_u16(size_t offset, uint16_t val) {
+    if (offset + 2 > len_) return;
+    buf_[offset] = (val >> 8) & 0xFF;
+    buf_[offset + 1] = val & 0xFF;
+}
+
+void MdnsPacketWriter::rollback(const Mark &m) {
+    len_ = m.len;
+    label_count_ = m.label_count;
+    overflow_ = false;
+}
+
+void MdnsPacketWriter::remember_label(size_t offset) {
+    // Compression pointers only have 14 bits of offset
+    if (label_count_ < MAX_LABELS && offset < 0x3FFF) {
+        labels_[label_count_++] = (uint16_t)offset;
+    }
+}
+
+// Look for an earlier occurrence of `suffix` in the packet. Returns its
+// offset, or 0 if there is none (offset 0 is the header, never a name).
+size_t MdnsPacketWriter::find_suffix(std::string_view suffix) const {
+    for (size_t n = 0; n < label_count_; ++n) {
+        size_t i = labels_[n];
+        std::string_view rest = suffix;
+        std::string_view label;
+        size_t jumps = 0;
+        bool match = false;
+
+        while (i < len_ && jumps < MAX_LABELS) {
+            uint8_t len = buf_[i];
+            if ((len & 0xC0) == 0xC0) {
+                if (i + 1 >= len_) break;
+                i = ((len & 0x3F) << 8) | buf_[i + 1];
+                jumps++;
+                continue;
+            }
+            if (len == 0) {
+                match = !next_label(rest, label);
+                break;
+            }
+            if (!next_label(rest, label) || label.size() != len || i + 1 + len > len_ ||
+                !label_equals(buf_ + i + 1, label)) {
+                break;
+            }
+            i += 1 + len;
+        }
+
+        if (match) return labels_[n];
+    }
+    return 0;
+}
+
+void MdnsPacketWriter::put_name(std::string_view name) {
+    std::string_view rest = name;
+    std::string_view label;
+
+    while (true) {
+        // Skip separators so `rest` starts at the label we are about to write
+        while (!rest.empty() && rest.front() == '.') rest.remove_prefix(1);
+        if (rest.empty()) break;
+
+        size_t target = find_suffix(rest);
+        if (target != 0) {
+            put_u16(0xC000 | (uint16_t)target);
+            return;
+        }
+
+        next_label(rest, label);
+        if (label.size() > 63) {
+            overflow_ = true; // Not representable as a DNS label
+            return;
+        }
+        if (!reserve(1 + label.size())) return;
+        remember_label(len_);
+        put_u8((uint8_t)label.size());
+        put_bytes(label.data(), label.size());
+    }
+    put_u8(0); // terminator
+}
+
+void MdnsPacketWriter::put_question(std::string_view name, uint16_t qtype, uint16_t qclass) {
+    put_name(name);
+    put_u16(qtype);
+    put_u16(qclass);
+}
+
+size_t MdnsPacketWriter::begin_record(std::string_view name, uint16_t type, uint16_t rrclass, uint32_t ttl) {
+    put_name(name);
+    put_u16(type);
+    put_u16(rrclass);
+    put_u32(ttl);
+    size_t handle = len_;
+    put_u16(0); // RDLENGTH placeholder
+    return handle;
+}
+
+void MdnsPacketWriter::end_record(size_t handle) {
+    if (overflow_) return;
+    patch_u16(handle, (uint16_t)(len_ - handle - 2));
+}
+
+bool MdnsWireName::set(std::string_view dotted) {
+    std::string_view rest = dotted;
+    std::string_view label;
+    len = 0;
+
+    while (next_label(rest, label)) {
+        if (label.size() > 63 || len + 1 + label.size() + 1 > sizeof(data)) {
+            len = 0;
+            return false;
+        }
+        data[len++] = (uint8_t)label.size();
+        memcpy(data + len, label.data(), label.size());
+        len += label.size();
+    }
+    if (len == 0) return false;
+    data[len++] = 0;
+    return true;
+}
+
+static uint16_t read_u16(const uint8_t* buf) {
+    return (uint16_t)buf[0] << 8 | buf[1];
+}
+
+static uint32_t read_u32(const uint8_t* buf) {
+    return (uint32_t)buf[0] << 24 | (uint32_t)buf[1] << 16 | (uint32_t)buf[2] << 8 | buf[3];
+}
+
+// Bound on compression pointers followed while decoding one name, so a
+// pointer loop in a hostile packet cannot spin forever.
+static const size_t MAX_POINTER_JUMPS = 16;
+
+MdnsPacketReader::MdnsPacketReader(const uint8_t* msg, size_t len)
+    : msg_(msg), len_(len) {
+    if (!valid()) {
+        malformed_ = true;
+        return;
+    }
+    flags_ = read_u16(msg + 2);
+    qdcount_ = read_u16(msg + 4);
+    uint32_t total = (uint32_t)read_u16(msg + 6) + read_u16(msg + 8) + read_u16(msg + 10);
+    rrcount_ = total > 0xFFFF ? 0xFFFF : (uint16_t)total;
+}
+
+bool MdnsPacketReader::skip_name(size_t &offset) const {
+    while (offset < len_) {
+        uint8_t len = msg_[offset];
+        if ((len & 0xC0) == 0xC0) {
+            if (offset + 2 > len_) return false;
+            offset += 2; // A pointer always ends the name
+            return true;
+        }
+        if ((len & 0xC0) != 0) return false; // Reserved label types
+        if (len == 0) {
+            offset += 1;
+            return true;
+        }
+        offset += 1 + len;
+    }
+    return false;
+}
+
+bool MdnsPacketReader::next_question(MdnsQuestion &q) {
+    if (malformed_ || questions_read_ >= qdcount_) return false;
+
+    size_t off = offset_;
+    if (!skip_name(off) || off + 4 > len_) {
+        malformed_ = true;
+        return false;
+    }
+    q.name_offset = offset_;
+    q.qtype = read_u16(msg_ + off);
+    q.qclass = read_u16(msg_ + off + 2);
+    offset_ = off + 4;
+    questions_read_++;
+    return true;
+}
+
+bool MdnsPacketReader::next_record(MdnsRecord &rr) {
+    MdnsQuestion q;
+    while (next_question(q)) {}
+    if (malformed_ || records_read_ >= rrcount_) return false;
+
+    size_t off = offset_;
+    if (!skip_name(off) || off + 10 > len_) {
+        malformed_ = true;
+        return false;
+    }
+    rr.name_offset = offset_;
+    rr.type = read_u16(msg_ + off);
+    rr.rrclass = read_u16(msg_ + off + 2);
+    rr.ttl = read_u32(msg_ + off + 4);
+    rr.rdlength = read_u16(msg_ + off + 8);
+    rr.rdata_offset = off + 10;
+    if (rr.rdata_offset + rr.rdlength > len_) {
+        malformed_ = true;
+        return false;
+    }
+    offset_ = rr.rdata_offset + rr.rdlength;
+    records_read_++;
+    return true;
+}
+
+bool MdnsPacketReader::name_equals(size_t offset, const MdnsWireName &name) const {
+    if (name.empty()) return false;
+
+    size_t i = offset;
+    size_t w = 0;
+    size_t jumps = 0;
+
+    while (i < len_ && w < name.len) {
+        uint8_t len = msg_[i];
+        if ((len & 0xC0) == 0xC0) {
+            if (i + 1 >= len_ || ++jumps > MAX_POINTER_JUMPS) return false;
+            i = ((len & 0x3F) << 8) | msg_[i + 1];
+            continue;
+        }
+        if (len != name.data[w]) return false;
+        if (len == 0) return true; // Both names ended together
+        if (i + 1 + len > len_) return false;
+        for (size_t k = 1; k <= len; ++k) {
+            if (std::tolower(msg_[i + k]) != std::tolower(name.data[w + k])) return false;
+        }
+        i += 1 + len;
+        w += 1 + len;
+    }
+    return false;
+}
+
+bool MdnsPacketReader::parent_equals(size_t offset, const MdnsWireName &name) const {
+    size_t i = offset;
+    size_t jumps = 0;
+
+    // Resolve pointers until we reach the first label
+    while (i < len_ && (msg_[i] & 0xC0) == 0xC0) {
+        if (i + 1 >= len_ || ++jumps > MAX_POINTER_JUMPS) return false;
+        i = ((msg_[i] & 0x3F) << 8) | msg_[i + 1];
+    }
+    if (i >= len_ || msg_[i] == 0) return false;
+    return name_equals(i + 1 + msg_[i], name);
+}
+
+bool MdnsPacketReader::read_name(size_t offset, std::string &out) const {
+    out.clear();
+    size_t i = offset;
+    size_t jumps = 0;
+
+    while (i < len_) {
+        uint8_t len = msg_[i];
+        if ((len & 0xC0) == 0xC0) {
+            if (i + 1 >= len_ || ++jumps > MAX_POINTER_JUMPS) return false;
+            i = ((len & 0x3F) << 8) | msg_[i + 1];
+            continue;
+        }
+        if (len == 0) return true;
+        if (i + 1 + len > len_ || out.size() + len + 1 > MDNS_MAX_NAME_WIRE) return false;
+        if (!out.empty()) out += '.';
+        out.append((const char*)(msg_ + i + 1), len);
+        i += 1 + len;
+    }
+    return false;
+}
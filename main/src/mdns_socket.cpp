@@ -1,27 +1,39 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <sys/select.h>
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
 #include <vector>
 #include <string>
 #include <set>
+#include <algorithm>
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_random.h"
 
 #include "mdns_socket.h"
+#include "mdns_packet.h"
 
 static const char* MDNS_MULTICAST_IP = "224.0.0.251";
 static const int MDNS_PORT = 5353;
 static const char* TAG = "mdns_socket";
 
-int mdns_setup_socket()
+// Upper bound on datagrams handled per wakeup, so a flood cannot starve the
+// announce/query timers. Anything left is picked up on the next pass.
+static const int MAX_PACKETS_PER_WAKEUP = 32;
+
+static MdnsStats s_stats = {};
+
+int mdns_setup_socket(const std::string &interface_ip)
 {
     int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
     if (sock < 0) {
+        ESP_LOGE(TAG, "mDNS socket setup failed");
         return -1;
     }   
 
@@ -38,77 +50,169 @@ int mdns_setup_socket()
     addr.sin_addr.s_addr = htonl(INADDR_ANY);
 
     if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        ESP_LOGE(TAG, "mDNS socket bind failed: %s", strerror(errno));
         close(sock);
         return -1;
     }
 
+    struct in_addr iface;
+    iface.s_addr = htonl(INADDR_ANY);
+    if (!interface_ip.empty() && inet_pton(AF_INET, interface_ip.c_str(), &iface) != 1) {
+        ESP_LOGW(TAG, "Invalid interface address %s, using default", interface_ip.c_str());
+        iface.s_addr = htonl(INADDR_ANY);
+    }
+
     struct ip_mreq mreq;
     mreq.imr_multiaddr.s_addr = inet_addr(MDNS_MULTICAST_IP);
-    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    mreq.imr_interface = iface;
     setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq));
 
-    struct timeval tv;
-    tv.tv_sec = 2;
-    tv.tv_usec = 0;
-    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-
-    if (sock < 0) {
-        ESP_LOGE(TAG, "mDNS socket setup failed");
+    // Send on the station interface and do not hear our own packets back
+    if (iface.s_addr != htonl(INADDR_ANY)) {
+        setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, &iface, sizeof(iface));
     }
+    uint8_t loop = 0;
+    setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+    uint8_t ttl = 255; // RFC 6762 section 11
+    setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
 
     return sock;
 }
 
-ssize_t send_mdns_ptr_query(const int &sock_mdns, const std::string &qname)
+static const struct sockaddr_in &mdns_multicast_addr()
+{
+    static struct sockaddr_in mcast_addr = [] {
+        struct sockaddr_in addr;
+        bzero(&addr, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(MDNS_PORT);
+        inet_pton(AF_INET, MDNS_MULTICAST_IP, &addr.sin_addr);
+        return addr;
+    }();
+    return mcast_addr;
+}
+
+// Send a finished packet to the mDNS multicast group.
+static ssize_t send_mdns_packet(const int &sock_mdns, const MdnsPacketWriter &packet)
 {
-    if (qname.empty() || sock_mdns < 0) {
+    if (!packet.ok()) {
+        ESP_LOGW(TAG, "mDNS packet exceeds %u bytes, not sent", (unsigned)MDNS_MAX_TX_PACKET);
         return -1;
     }
-    std::vector<uint8_t> query;
-    query.resize(12); // DNS header
-    // ID = 0 for mDNS
-    query[0] = 0; query[1] = 0;
-    // Flags = 0 (standard query)
-    query[2] = 0; query[3] = 0;
-    // QDCOUNT = 1
-    query[4] = 0; query[5] = 1;
-    // ANCOUNT, NSCOUNT, ARCOUNT = 0
-    query[6] = 0; query[7] = 0; query[8] = 0; query[9] = 0; query[10] = 0; query[11] = 0;
-
-    auto push_label = [&](const std::string &s) {
-        uint8_t len = (uint8_t)s.size();
-        query.push_back(len);
-        query.insert(query.end(), s.begin(), s.end());
-    };
-
-    // Split the qname on '.' and push each label
-    size_t start = 0;
-    while (start < qname.size()) {
-        size_t dot = qname.find('.', start);
-        std::string label;
-        if (dot == std::string::npos) {
-            label = qname.substr(start);
-            start = qname.size();
-        } else {
-            label = qname.substr(start, dot - start);
-            start = dot + 1;
+
+    const struct sockaddr_in &mcast_addr = mdns_multicast_addr();
+    return sendto(sock_mdns, packet.data(), packet.size(), 0,
+                  (struct sockaddr*)&mcast_addr, sizeof(mcast_addr));
+}
+
+ssize_t send_mdns_query(const int &sock_mdns, const std::string &name, uint16_t qtype)
+{
+    if (name.empty() || sock_mdns < 0) {
+        return -1;
+    }
+
+    uint8_t buf[MDNS_MAX_TX_PACKET];
+    MdnsPacketWriter query(buf, sizeof(buf));
+    query.header(0, 1, 0, 0, 0); // Standard query, QDCOUNT = 1
+    query.put_question(name, qtype, MDNS_CLASS_IN);
+
+    return send_mdns_packet(sock_mdns, query);
+}
+
+ssize_t send_mdns_ptr_query(const int &sock_mdns, const std::string &qname)
+{
+    return send_mdns_query(sock_mdns, qname, MDNS_TYPE_PTR);
+}
+
+// A query from a legacy resolver (source port other than 5353). Its reply
+// differs from a multicast one (RFC 6762 section 6.7): it echoes the query
+// ID and question, has no cache-flush bits, and keeps TTLs at 10 s or less.
+struct LegacyQuery {
+    uint16_t id;
+    std::string name;
+    uint16_t qtype;
+    uint16_t qclass;
+};
+static const uint32_t LEGACY_MAX_TTL = 10;
+
+static uint32_t record_ttl(uint32_t ttl, const LegacyQuery* legacy) {
+    return legacy ? std::min(ttl, LEGACY_MAX_TTL) : ttl;
+}
+
+// Follow the header with the question a legacy reply answers.
+static void write_legacy_question(MdnsPacketWriter &response, const LegacyQuery* legacy) {
+    if (!legacy) return;
+    response.patch_u16(0, legacy->id);
+    response.put_question(legacy->name, legacy->qtype, legacy->qclass);
+}
+
+// Write the full service description: PTR, SRV and TXT answers plus the A
+// record as an additional. `instance_name` must be a single label (spaces
+// are fine, dots are not). Returns false if the packet does not fit.
+static bool write_service_response(MdnsPacketWriter &response, const std::string &service_type,
+                                   const std::string &instance_name, const std::string &hostname,
+                                   const struct in_addr &addr, uint16_t port,
+                                   const std::vector<std::string> &txt_records,
+                                   const LegacyQuery* legacy = nullptr)
+{
+    // ANCOUNT = 3 (PTR, SRV, TXT), ARCOUNT = 1 (A record)
+    response.header(MDNS_FLAGS_RESPONSE, legacy ? 1 : 0, 3, 0, 1);
+    write_legacy_question(response, legacy);
+    uint16_t flush = legacy ? 0 : MDNS_CLASS_FLUSH;
+
+    // The full instance name is written once in the PTR RDATA; the SRV and
+    // TXT owner names then compress to a single pointer.
+    char full_instance[256];
+    int full_len = snprintf(full_instance, sizeof(full_instance), "%s.%s",
+                            instance_name.c_str(), service_type.c_str());
+    if (full_len <= 0 || (size_t)full_len >= sizeof(full_instance)) {
+        return false;
+    }
+    std::string_view instance(full_instance, full_len);
+
+    // 1. PTR Record: service_type -> full_instance (no cache-flush for shared PTR)
+    size_t rec = response.begin_record(service_type, MDNS_TYPE_PTR, MDNS_CLASS_IN, record_ttl(4500, legacy));
+    response.put_name(instance);
+    response.end_record(rec);
+
+    // 2. SRV Record: full_instance -> hostname:port
+    rec = response.begin_record(instance, MDNS_TYPE_SRV, MDNS_CLASS_IN | flush, record_ttl(120, legacy));
+    response.put_u16(0);  // Priority
+    response.put_u16(0);  // Weight
+    response.put_u16(port);
+    response.put_name(hostname);
+    response.end_record(rec);
+
+    // 3. TXT Record: full_instance -> txt data
+    rec = response.begin_record(instance, MDNS_TYPE_TXT, MDNS_CLASS_IN | flush, record_ttl(4500, legacy));
+    if (txt_records.empty()) {
+        response.put_u8(0);  // Empty TXT record
+    } else {
+        for (const auto &txt : txt_records) {
+            response.put_u8((uint8_t)txt.size());
+            response.put_bytes(txt.data(), txt.size());
         }
-        if (!label.empty()) push_label(label);
-    }
-    query.push_back(0); // term
-    // QTYPE = PTR(12)
-    query.push_back(0); query.push_back(12);
-    // QCLASS = IN (1)
-    query.push_back(0); query.push_back(1);
-
-    struct sockaddr_in mcast_addr;
-    bzero(&mcast_addr, sizeof(mcast_addr));
-    mcast_addr.sin_family = AF_INET;
-    mcast_addr.sin_port = htons(MDNS_PORT);
-    inet_pton(AF_INET, MDNS_MULTICAST_IP, &mcast_addr.sin_addr);
-
-    ssize_t sent = sendto(sock_mdns, query.data(), query.size(), 0, (struct sockaddr*)&mcast_addr, sizeof(mcast_addr));
-    return sent;
+    }
+    response.end_record(rec);
+
+    // 4. A Record: hostname -> IPv4 address (in Additional Records section)
+    rec = response.begin_record(hostname, MDNS_TYPE_A, MDNS_CLASS_IN | flush, record_ttl(120, legacy));
+    response.put_bytes(&addr.s_addr, 4); // s_addr is already in network order
+    response.end_record(rec);
+    return response.ok();
+}
+
+// Write a response carrying only the A record (hostname -> IP).
+static void write_a_response(MdnsPacketWriter &response, const std::string &hostname, const struct in_addr &addr,
+                             const LegacyQuery* legacy = nullptr)
+{
+    response.header(MDNS_FLAGS_RESPONSE, legacy ? 1 : 0, 1, 0, 0); // ANCOUNT = 1 (just A record)
+    write_legacy_question(response, legacy);
+
+    size_t rec = response.begin_record(hostname, MDNS_TYPE_A, MDNS_CLASS_IN | (legacy ? 0 : MDNS_CLASS_FLUSH),
+                                       record_ttl(120, legacy));
+    response.put_bytes(&addr.s_addr, 4); // s_addr is already in network order
+    response.end_record(rec);
 }
 
 // Broadcast an mDNS service announcement (unsolicited response)
@@ -128,132 +232,18 @@ ssize_t send_mdns_announcement(const int &sock_mdns, const std::string &service_
         return -1;
     }
 
-    std::vector<uint8_t> response;
-    response.resize(12); // DNS header
-
-    // ID = 0 for mDNS
-    response[0] = 0; response[1] = 0;
-    // Flags = 0x8400 (response, authoritative)
-    response[2] = 0x84; response[3] = 0x00;
-    // QDCOUNT = 0
-    response[4] = 0; response[5] = 0;
-    // ANCOUNT = 3 (PTR, SRV, TXT)
-    response[6] = 0; response[7] = 3;
-    // NSCOUNT = 0, ARCOUNT = 1 (A record)
-    response[8] = 0; response[9] = 0; response[10] = 0; response[11] = 1;
-
-    auto push_label = [&](const std::string &s) {
-        uint8_t len = (uint8_t)s.size();
-        response.push_back(len);
-        response.insert(response.end(), s.begin(), s.end());
-    };
-
-    auto push_name = [&](const std::string &name) {
-        size_t start = 0;
-        while (start < name.size()) {
-            size_t dot = name.find('.', start);
-            std::string label;
-            if (dot == std::string::npos) {
-                label = name.substr(start);
-                start = name.size();
-            } else {
-                label = name.substr(start, dot - start);
-                start = dot + 1;
-            }
-            if (!label.empty()) push_label(label);
-        }
-        response.push_back(0); // terminator
-    };
-
-    auto push_u16 = [&](uint16_t val) {
-        response.push_back((val >> 8) & 0xFF);
-        response.push_back(val & 0xFF);
-    };
-
-    auto push_u32 = [&](uint32_t val) {
-        response.push_back((val >> 24) & 0xFF);
-        response.push_back((val >> 16) & 0xFF);
-        response.push_back((val >> 8) & 0xFF);
-        response.push_back(val & 0xFF);
-    };
-
-    std::string full_instance = instance_name + "." + service_type;
-
-    // 1. PTR Record: service_type -> full_instance
-    push_name(service_type);
-    push_u16(12);  // TYPE = PTR
-    push_u16(0x0001);  // CLASS = IN (no cache-flush for PTR)
-    push_u32(4500);  // TTL = 4500 seconds
-    size_t ptr_rdlen_pos = response.size();
-    push_u16(0);  // RDLENGTH placeholder
-    size_t ptr_rdata_start = response.size();
-    push_name(full_instance);
-    uint16_t ptr_rdlen = response.size() - ptr_rdata_start;
-    response[ptr_rdlen_pos] = (ptr_rdlen >> 8) & 0xFF;
-    response[ptr_rdlen_pos + 1] = ptr_rdlen & 0xFF;
-
-    // 2. SRV Record: full_instance -> hostname:port
-    push_name(full_instance);
-    push_u16(33);  // TYPE = SRV
-    push_u16(0x8001);  // CLASS = IN with cache-flush bit
-    push_u32(120);  // TTL
-    size_t srv_rdlen_pos = response.size();
-    push_u16(0);  // RDLENGTH placeholder
-    size_t srv_rdata_start = response.size();
-    push_u16(0);  // Priority
-    push_u16(0);  // Weight
-    push_u16(port);  // Port
-    push_name(hostname);
-    uint16_t srv_rdlen = response.size() - srv_rdata_start;
-    response[srv_rdlen_pos] = (srv_rdlen >> 8) & 0xFF;
-    response[srv_rdlen_pos + 1] = srv_rdlen & 0xFF;
-
-    // 3. TXT Record: full_instance -> txt data
-    push_name(full_instance);
-    push_u16(16);  // TYPE = TXT
-    push_u16(0x8001);  // CLASS = IN with cache-flush bit
-    push_u32(4500);  // TTL
-    size_t txt_rdlen_pos = response.size();
-    push_u16(0);  // RDLENGTH placeholder
-    size_t txt_rdata_start = response.size();
-    if (txt_records.empty()) {
-        response.push_back(0);  // Empty TXT record
-    } else {
-        for (const auto &txt : txt_records) {
-            uint8_t txt_len = (uint8_t)txt.size();
-            response.push_back(txt_len);
-            response.insert(response.end(), txt.begin(), txt.end());
-        }
-    }
-    uint16_t txt_rdlen = response.size() - txt_rdata_start;
-    response[txt_rdlen_pos] = (txt_rdlen >> 8) & 0xFF;
-    response[txt_rdlen_pos + 1] = txt_rdlen & 0xFF;
-
-    // 4. A Record: hostname -> IPv4 address (in Additional Records section)
-    push_name(hostname);
-    push_u16(1);  // TYPE = A
-    push_u16(0x8001);  // CLASS = IN with cache-flush bit
-    push_u32(120);  // TTL
-    push_u16(4);  // RDLENGTH = 4 bytes for IPv4
     struct in_addr addr;
-    if (inet_pton(AF_INET, ipv4_addr.c_str(), &addr) == 1) {
-        response.push_back((addr.s_addr >> 0) & 0xFF);
-        response.push_back((addr.s_addr >> 8) & 0xFF);
-        response.push_back((addr.s_addr >> 16) & 0xFF);
-        response.push_back((addr.s_addr >> 24) & 0xFF);
-    } else {
+    if (inet_pton(AF_INET, ipv4_addr.c_str(), &addr) != 1) {
         return -1;  // Invalid IP address
     }
 
-    struct sockaddr_in mcast_addr;
-    bzero(&mcast_addr, sizeof(mcast_addr));
-    mcast_addr.sin_family = AF_INET;
-    mcast_addr.sin_port = htons(MDNS_PORT);
-    inet_pton(AF_INET, MDNS_MULTICAST_IP, &mcast_addr.sin_addr);
-
-    ssize_t sent = sendto(sock_mdns, response.data(), response.size(), 0, 
-                          (struct sockaddr*)&mcast_addr, sizeof(mcast_addr));
-    return sent;
+    uint8_t buf[MDNS_MAX_TX_PACKET];
+    MdnsPacketWriter response(buf, sizeof(buf));
+    if (!write_service_response(response, service_type, instance_name, hostname, addr, port, txt_records)) {
+        ESP_LOGW(TAG, "Announcement for %s does not fit in one packet", instance_name.c_str());
+        return -1;
+    }
+    return send_mdns_packet(sock_mdns, response);
 }
 
 // Broadcast a simple mDNS A record announcement (hostname -> IP)
@@ -263,249 +253,617 @@ ssize_t send_mdns_a_record(const int &sock_mdns, const std::string &hostname, co
         return -1;
     }
 
-    std::vector<uint8_t> response;
-    response.resize(12); // DNS header
-
-    // ID = 0 for mDNS
-    response[0] = 0; response[1] = 0;
-    // Flags = 0x8400 (response, authoritative)
-    response[2] = 0x84; response[3] = 0x00;
-    // QDCOUNT = 0
-    response[4] = 0; response[5] = 0;
-    // ANCOUNT = 1 (just A record)
-    response[6] = 0; response[7] = 1;
-    // NSCOUNT = 0, ARCOUNT = 0
-    response[8] = 0; response[9] = 0; response[10] = 0; response[11] = 0;
-
-    auto push_label = [&](const std::string &s) {
-        uint8_t len = (uint8_t)s.size();
-        response.push_back(len);
-        response.insert(response.end(), s.begin(), s.end());
-    };
-
-    auto push_name = [&](const std::string &name) {
-        size_t start = 0;
-        while (start < name.size()) {
-            size_t dot = name.find('.', start);
-            std::string label;
-            if (dot == std::string::npos) {
-                label = name.substr(start);
-                start = name.size();
-            } else {
-                label = name.substr(start, dot - start);
-                start = dot + 1;
-            }
-            if (!label.empty()) push_label(label);
-        }
-        response.push_back(0); // terminator
-    };
-
-    auto push_u16 = [&](uint16_t val) {
-        response.push_back((val >> 8) & 0xFF);
-        response.push_back(val & 0xFF);
-    };
-
-    auto push_u32 = [&](uint32_t val) {
-        response.push_back((val >> 24) & 0xFF);
-        response.push_back((val >> 16) & 0xFF);
-        response.push_back((val >> 8) & 0xFF);
-        response.push_back(val & 0xFF);
-    };
-
-    // A Record: hostname -> IPv4 address
-    push_name(hostname);
-    push_u16(1);  // TYPE = A
-    push_u16(0x8001);  // CLASS = IN with cache-flush bit
-    push_u32(120);  // TTL = 120 seconds
-    push_u16(4);  // RDLENGTH = 4 bytes for IPv4
-
     struct in_addr addr;
-    if (inet_pton(AF_INET, ipv4_addr.c_str(), &addr) == 1) {
-        response.push_back((addr.s_addr >> 0) & 0xFF);
-        response.push_back((addr.s_addr >> 8) & 0xFF);
-        response.push_back((addr.s_addr >> 16) & 0xFF);
-        response.push_back((addr.s_addr >> 24) & 0xFF);
-    } else {
+    if (inet_pton(AF_INET, ipv4_addr.c_str(), &addr) != 1) {
         return -1;  // Invalid IP address
     }
 
-    struct sockaddr_in mcast_addr;
-    bzero(&mcast_addr, sizeof(mcast_addr));
-    mcast_addr.sin_family = AF_INET;
-    mcast_addr.sin_port = htons(MDNS_PORT);
-    inet_pton(AF_INET, MDNS_MULTICAST_IP, &mcast_addr.sin_addr);
+    uint8_t buf[MDNS_MAX_TX_PACKET];
+    MdnsPacketWriter response(buf, sizeof(buf));
+    write_a_response(response, hostname, addr);
+    return send_mdns_packet(sock_mdns, response);
+}
+
 
-    ssize_t sent = sendto(sock_mdns, response.data(), response.size(), 0, 
-                          (struct sockaddr*)&mcast_addr, sizeof(mcast_addr));
-    return sent;
+void TaskConfiguration::prepare() {
+    qname_wire.set(qname);
+    hostname_wire.set(mdns_hostname);
+    service_wire.set(service_type);
+    instance_wire.set(instance_name + "." + service_type);
 }
 
+// TTL of our PTR record; known answers with at least half of it left
+// suppress our reply (RFC 6762 section 7.1).
+static const uint32_t SERVICE_PTR_TTL = 4500;
+
+// A response serialized once and replayed for every query it answers.
+// `last_multicast_us` enforces the one-second minimum between multicasts
+// of the same records (RFC 6762 section 6).
+struct PreparedResponse {
+    uint8_t data[MDNS_MAX_TX_PACKET];
+    size_t len;
+    int64_t last_multicast_us;
+};
+static const int64_t MIN_MULTICAST_INTERVAL_US = 1000000;
+
+// PTR + SRV + TXT with the A record as an additional, and the A record alone.
+// Rebuilt only when the address or one of the advertised names changes.
+static PreparedResponse s_service_response = {};
+static PreparedResponse s_host_response = {};
+
+// The inputs the prepared responses were built from
+struct PreparedFor {
+    std::string ip;
+    std::string hostname;
+    std::string instance_name;
+    std::string service_type;
+    uint16_t port;
+};
+static PreparedFor s_prepared_for = {};
+
+// Responses waiting out their random delay, or the rest of the one-second
+// multicast interval (RFC 6762 section 6)
+struct PendingResponse {
+    bool active;
+    int64_t due_us;
+    PreparedResponse* response;
+    struct sockaddr_in dest;
+};
+static const size_t MAX_PENDING_RESPONSES = 4;
+static PendingResponse s_pending[MAX_PENDING_RESPONSES] = {};
+
+// Make sure the prepared responses match the current address and names.
+// Returns false if there is nothing valid to answer with.
+static bool refresh_prepared_responses(const TaskConfiguration &config) {
+    PreparedFor &prepared = s_prepared_for;
+    if (prepared.ip == config.our_ip && prepared.hostname == config.mdns_hostname &&
+        prepared.instance_name == config.instance_name && prepared.service_type == config.service_type &&
+        prepared.port == config.service_port && !prepared.ip.empty()) {
+        return s_service_response.len > 0;
+    }
+    prepared = {config.our_ip, config.mdns_hostname, config.instance_name, config.service_type, config.service_port};
+    s_service_response.len = 0;
+    s_service_response.last_multicast_us = 0;
+    s_host_response.len = 0;
+    s_host_response.last_multicast_us = 0;
 
-// Helper to read big-endian 16/32-bit values from buffer
-static uint16_t read_u16(const uint8_t* buf) {
-    return (uint16_t)buf[0] << 8 | buf[1];
+    struct in_addr addr;
+    if (config.mdns_hostname.empty() || inet_pton(AF_INET, config.our_ip.c_str(), &addr) != 1) {
+        return false;
+    }
+
+    MdnsPacketWriter service(s_service_response.data, sizeof(s_service_response.data));
+    if (write_service_response(service, config.service_type, config.instance_name,
+                               config.mdns_hostname, addr, config.service_port, {})) {
+        s_service_response.len = service.size();
+    }
+    MdnsPacketWriter host(s_host_response.data, sizeof(s_host_response.data));
+    write_a_response(host, config.mdns_hostname, addr);
+    if (host.ok()) {
+        s_host_response.len = host.size();
+    }
+
+    ESP_LOGI(TAG, "Prepared mDNS responses for %s at %s (%u + %u bytes)", config.mdns_hostname.c_str(),
+             config.our_ip.c_str(), (unsigned)s_service_response.len, (unsigned)s_host_response.len);
+    return s_service_response.len > 0;
 }
 
-static uint32_t read_u32(const uint8_t* buf) {
-    return (uint32_t)buf[0] << 24 | (uint32_t)buf[1] << 16 | (uint32_t)buf[2] << 8 | buf[3];
+static bool same_dest(const struct sockaddr_in &a, const struct sockaddr_in &b) {
+    return a.sin_addr.s_addr == b.sin_addr.s_addr && a.sin_port == b.sin_port;
 }
 
-// Parse a domain name from an mDNS/DNS message handling compression pointers.
-// msg_start: pointer to beginning of message; msg_len total length; offset is
-// advanced past the name (except when a pointer is encountered, pointer
-// bytes are consumed). Returns a std::string name (without trailing dot).
-static std::string parse_name(const uint8_t* msg_start, size_t msg_len, size_t &offset) {
-    std::string name;
-    if (offset >= msg_len) return name;
-
-    size_t i = offset;
-    bool jumped = false;
-    size_t jumps = 0;
-
-    while (i < msg_len && jumps < msg_len) {
-        uint8_t len = msg_start[i];
-        // pointer?
-        if ((len & 0xC0) == 0xC0) {
-            if (i + 1 >= msg_len) return name;
-            uint16_t pointer = ((len & 0x3F) << 8) | msg_start[i + 1];
-            if (pointer >= msg_len) return name;
-            // Advance the top-level offset only once for the pointer
-            if (!jumped) {
-                offset = i + 2;
-            }
-            i = pointer;
-            jumped = true;
-            jumps++;
-            continue;
+// Queue `response` to go out at `due_us`. A response already queued for the
+// same destination absorbs this one (and sets `absorbed`). Returns false if
+// every slot is taken.
+static bool queue_response(PreparedResponse &response, const struct sockaddr_in &dest, int64_t due_us,
+                           bool* absorbed = nullptr) {
+    PendingResponse* free_slot = nullptr;
+    for (auto &pending : s_pending) {
+        if (pending.active && pending.response == &response && same_dest(pending.dest, dest)) {
+            pending.due_us = std::min(pending.due_us, due_us);
+            if (absorbed) *absorbed = true;
+            return true;
         }
+        if (!pending.active && !free_slot) free_slot = &pending;
+    }
+    if (!free_slot) return false;
+    *free_slot = {true, due_us, &response, dest};
+    return true;
+}
 
-        if (len == 0) {
-            // end of name
-            if (!jumped) offset = i + 1;
-            break;
+// Earliest time `response` may go to `dest`: multicasts of the same records
+// are kept a second apart.
+static int64_t earliest_send_us(const PreparedResponse &response, const struct sockaddr_in &dest) {
+    bool multicast = dest.sin_addr.s_addr == mdns_multicast_addr().sin_addr.s_addr;
+    if (!multicast || response.last_multicast_us == 0) return 0;
+    return response.last_multicast_us + MIN_MULTICAST_INTERVAL_US;
+}
+
+// Send a prepared response to `dest`. A multicast within a second of the last one of the same records is held
+// back until that second is up rather than dropped, so the querier still
+// gets its answer.
+static void send_prepared(const TaskConfiguration &config, PreparedResponse &response,
+                          const struct sockaddr_in &dest) {
+    if (response.len == 0) return;
+
+    bool multicast = dest.sin_addr.s_addr == mdns_multicast_addr().sin_addr.s_addr;
+    int64_t now = esp_timer_get_time();
+    int64_t allowed_us = earliest_send_us(response, dest);
+    if (now < allowed_us) {
+        bool absorbed = false;
+        if (queue_response(response, dest, allowed_us, &absorbed) && !absorbed) {
+            s_stats.responses_deferred++;
+        } else {
+            s_stats.responses_rate_limited++; // Already pending, or no slot to wait in
         }
+        return;
+    }
 
-        // label
-        if (i + 1 + len > msg_len) return name;
-        if (!name.empty()) name += ".";
-        name.append((const char*)(msg_start + i + 1), len);
-        if (!jumped) offset = i + 1 + len;
-        i += 1 + len;
+    if (sendto(config.sock_mdns, response.data, response.len, 0, (const struct sockaddr*)&dest, sizeof(dest)) < 0) {
+        s_stats.send_errors++;
+    } else {
+        s_stats.responses_sent++;
+        if (multicast) response.last_multicast_us = now;
     }
 
-    return name;
+    // Anything still queued for the same destination is now redundant
+    for (auto &pending : s_pending) {
+        if (pending.active && pending.response == &response && same_dest(pending.dest, dest)) {
+            pending.active = false;
+        }
+    }
+}
+
+// Queue `response` to go out at `due_us`, or once the multicast interval is
+// up if that is later; with no free slot it is sent now.
+static void schedule_response(const TaskConfiguration &config, PreparedResponse &response,
+                              const struct sockaddr_in &dest, int64_t due_us) {
+    int64_t allowed_us = earliest_send_us(response, dest);
+    bool absorbed = false;
+    if (!queue_response(response, dest, std::max(due_us, allowed_us), &absorbed)) {
+        send_prepared(config, response, dest);
+    } else if (allowed_us > due_us && !absorbed) {
+        s_stats.responses_deferred++;
+    }
 }
 
-// Normalize DNS/mDNS names for matching keys: lowercase and remove a
-// trailing dot if present. This avoids mismatches between records that use
-// different case or include/exclude the final dot.
-static std::string normalize_dns_name(const std::string &s) {
-    std::string out = s;
-    if (!out.empty() && out.back() == '.') out.pop_back();
-    for (auto &c : out) c = (char)std::tolower((unsigned char)c);
-    return out;
+// Send the queued responses whose delay has elapsed.
+static void flush_pending_responses(const TaskConfiguration &config, int64_t now) {
+    for (auto &pending : s_pending) {
+        if (pending.active && pending.due_us <= now) {
+            pending.active = false;
+            send_prepared(config, *pending.response, pending.dest);
+        }
+    }
+}
+
+static int64_t next_pending_deadline() {
+    int64_t deadline = INT64_MAX;
+    for (const auto &pending : s_pending) {
+        if (pending.active) deadline = std::min(deadline, pending.due_us);
+    }
+    return deadline;
+}
+
+// Answer a legacy resolver with a reply built for it alone, answering
+// `question` with the service description or just our address.
+static void send_legacy_reply(const TaskConfiguration &config, const MdnsPacketReader &packet,
+                              const MdnsQuestion &question, bool service, const struct sockaddr_in &dest) {
+    struct in_addr addr;
+    if (inet_pton(AF_INET, config.our_ip.c_str(), &addr) != 1) return;
+
+    LegacyQuery legacy;
+    legacy.id = (uint16_t)(packet.data()[0] << 8 | packet.data()[1]);
+    if (!packet.read_name(question.name_offset, legacy.name)) return;
+    legacy.qtype = question.qtype;
+    legacy.qclass = question.qclass;
+
+    uint8_t buf[MDNS_MAX_TX_PACKET];
+    MdnsPacketWriter reply(buf, sizeof(buf));
+    if (service) {
+        write_service_response(reply, config.service_type, config.instance_name, config.mdns_hostname,
+                               addr, config.service_port, {}, &legacy);
+    } else {
+        write_a_response(reply, config.mdns_hostname, addr, &legacy);
+    }
+    if (!reply.ok()) return;
+
+    if (sendto(config.sock_mdns, reply.data(), reply.size(), 0, (const struct sockaddr*)&dest, sizeof(dest)) < 0) {
+        s_stats.send_errors++;
+    } else {
+        s_stats.responses_sent++;
+    }
 }
 
-// Unified mDNS socket task that handles both:
-// 1. Listening for service discovery responses (PTR/SRV/A records)
-// 2. Responding to mDNS queries for our hostname
-// This ensures a single thread processes all mDNS socket traffic without conflicts.
-void mdns_socket_task(const int &sock_mdns, const std::string &qname, std::set<std::string> &set_ip, 
-                      const std::string &our_hostname, const std::string &our_ip) {
-    std::string normalized_qname = normalize_dns_name(qname);
-    std::string normalized_hostname = normalize_dns_name(our_hostname);
-
-    // buffer for incoming packets
-    const size_t BUF_SZ = 1500;
-    uint8_t buf[BUF_SZ];
-
-    // receive ONE packet (caller will call us in a loop)
-    struct sockaddr_in src;
-    socklen_t slen = sizeof(src);
-    ssize_t len = recvfrom(sock_mdns, buf, BUF_SZ, 0, (struct sockaddr*)&src, &slen);
-    if (len <= 0) {
-        if (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
-            ESP_LOGW(TAG, "recvfrom() error: %s", strerror(errno));
+// Answer a query for our service, instance or hostname.
+//  - PTR questions for the service are shared records: the reply is delayed
+//    20-120 ms (400-500 ms if more known answers follow, TC bit) and skipped
+//    if the querier already listed our instance with at least half its TTL.
+//  - SRV/TXT/ANY for our instance and A/ANY for our hostname are unique
+//    records and are answered immediately.
+//  - QU questions (top bit of qclass) and legacy resolvers get a unicast
+//    reply to the source address.
+static void handle_query(TaskConfiguration &config, MdnsPacketReader &packet, const struct sockaddr_in &src) {
+    bool want_ptr = false;
+    bool want_service = false;
+    bool want_host = false;
+    bool unicast = false;
+    MdnsQuestion asked = {}; // First question we answer, echoed to legacy resolvers
+
+    MdnsQuestion q;
+    while (packet.next_question(q)) {
+        uint16_t qclass = q.qclass & ~MDNS_CLASS_FLUSH; // Top bit is the QU flag in questions
+        if (qclass != MDNS_CLASS_IN && qclass != 255) continue; // IN class or ANY
+
+        bool matched = false;
+        if ((q.qtype == MDNS_TYPE_PTR || q.qtype == MDNS_TYPE_ANY) &&
+            packet.name_equals(q.name_offset, config.service_wire)) {
+            want_ptr = matched = true;
+        } else if ((q.qtype == MDNS_TYPE_SRV || q.qtype == MDNS_TYPE_TXT || q.qtype == MDNS_TYPE_ANY) &&
+                   packet.name_equals(q.name_offset, config.instance_wire)) {
+            want_service = matched = true;
+        } else if ((q.qtype == MDNS_TYPE_A || q.qtype == MDNS_TYPE_ANY) &&
+                   packet.name_equals(q.name_offset, config.hostname_wire)) {
+            want_host = matched = true;
+        }
+        if (matched && asked.qtype == 0) asked = q;
+        if (matched && (q.qclass & MDNS_CLASS_FLUSH)) unicast = true;
+    }
+    if (!want_ptr && !want_service && !want_host) return;
+    if (!refresh_prepared_responses(config)) return;
+
+    // Known-answer suppression for the shared PTR record
+    if (want_ptr && !want_service) {
+        MdnsRecord rr;
+        while (packet.next_record(rr)) {
+            if (rr.type == MDNS_TYPE_PTR && rr.ttl >= SERVICE_PTR_TTL / 2 &&
+                packet.name_equals(rr.name_offset, config.service_wire) &&
+                packet.name_equals(rr.rdata_offset, config.instance_wire)) {
+                want_ptr = false;
+                s_stats.responses_suppressed++;
+                break;
+            }
         }
-        return; // Timeout or error, return to caller
     }
 
-    if (len < 12) return; // Too short to be valid DNS
+    bool legacy = ntohs(src.sin_port) != MDNS_PORT;
+    const struct sockaddr_in &dest = (unicast || legacy) ? src : mdns_multicast_addr();
 
-    // Parse DNS header
-    uint16_t flags = read_u16(buf + 2);
-    uint16_t qdcount = read_u16(buf + 4);
-    uint16_t ancount = read_u16(buf + 6);
-    uint16_t nscount = read_u16(buf + 8);
-    uint16_t arcount = read_u16(buf + 10);
+    ESP_LOGD(TAG, "Query for %s%s%s from %s (%s)", want_ptr ? "PTR " : "", want_service ? "SRV/TXT " : "",
+             want_host ? "A " : "", inet_ntoa(src.sin_addr), (unicast || legacy) ? "unicast" : "multicast");
 
-    bool is_query = !(flags & 0x8000); // QR bit = 0 means query
-    size_t offset = 12;
+    if (legacy) {
+        // Legacy resolvers do not wait around for a delayed answer
+        if (want_ptr || want_service || want_host) {
+            send_legacy_reply(config, packet, asked, want_ptr || want_service, src);
+        }
+    } else if (want_service) {
+        send_prepared(config, s_service_response, dest);
+    } else if (want_ptr) {
+        int64_t delay_us = (packet.flags() & MDNS_FLAGS_TC) ? 400000 + esp_random() % 100000
+                                                            : 20000 + esp_random() % 100000;
+        schedule_response(config, s_service_response, dest, esp_timer_get_time() + delay_us);
+    } else if (want_host) {
+        send_prepared(config, s_host_response, dest);
+    }
+}
 
-    // Process questions (for queries and responses)
-    if (is_query && qdcount > 0) {
-        // This is a query - check if someone is asking for our hostname
-        for (int q = 0; q < qdcount; ++q) {
-            if (offset >= (size_t)len) break;
+// Handle one received packet:
+// 1. Queries for our service, instance or hostname are answered
+// 2. Responses are scanned for service discovery records (PTR/SRV/TXT, then
+//    A), which are recorded in the discovery cache along with their TTLs
+//
+// Names in incoming packets are compared in place against the prepared
+// wire-format names; strings are only built for records we keep.
+static void handle_packet(TaskConfiguration &config, const uint8_t* buf, size_t len, const struct sockaddr_in &src) {
+    MdnsPacketReader packet(buf, len);
+    if (!packet.valid()) {
+        s_stats.dropped_malformed++;
+        return; // Too short to be valid DNS
+    }
 
-            std::string qname_parsed = parse_name(buf, len, offset);
-            if (offset + 4 > (size_t)len) break;
+    if (!packet.is_response()) {
+        handle_query(config, packet, src);
+        if (packet.malformed()) s_stats.dropped_malformed++;
+        return;
+    }
+
+    // This is a response - process answers for service discovery
+    // Reused across packets so decoding names does not reallocate
+    static std::string name;
+    static std::string value;
+    static std::vector<std::string> txt;
+
+    int64_t now = esp_timer_get_time();
+    bool found_matching_qname = false;
+    MdnsRecord rr;
+    while (packet.next_record(rr)) {
+        bool is_watched = packet.name_equals(rr.name_offset, config.qname_wire);
+        bool is_instance = !is_watched && packet.parent_equals(rr.name_offset, config.qname_wire);
+        found_matching_qname |= is_watched || is_instance;
+        if ((rr.rrclass & ~MDNS_CLASS_FLUSH) != MDNS_CLASS_IN) continue;
+
+        if (rr.type == MDNS_TYPE_PTR && is_watched) {
+            // service -> instance; a TTL of 0 is a goodbye
+            if (packet.read_name(rr.rdata_offset, value)) {
+                config.discovery_cache->update(MDNS_TYPE_PTR, config.qname, value, rr.ttl, now);
+            }
+        } else if (rr.type == MDNS_TYPE_SRV && is_instance && rr.rdlength > 6) {
+            // instance -> priority, weight, port, target host
+            const uint8_t* rdata = packet.data() + rr.rdata_offset;
+            uint16_t port = (uint16_t)rdata[4] << 8 | rdata[5];
+            if (packet.read_name(rr.name_offset, name) && packet.read_name(rr.rdata_offset + 6, value)) {
+                config.discovery_cache->update_srv(name, value, port, rr.ttl, now);
+            }
+        } else if (rr.type == MDNS_TYPE_TXT && is_instance) {
+            // instance -> sequence of length-prefixed "key=value" strings
+            if (!packet.read_name(rr.name_offset, name)) continue;
+            txt.clear();
+            const uint8_t* rdata = packet.data() + rr.rdata_offset;
+            size_t pos = 0;
+            while (pos < rr.rdlength) {
+                uint8_t entry_len = rdata[pos++];
+                if (pos + entry_len > rr.rdlength) break;
+                if (entry_len > 0) txt.emplace_back((const char*)rdata + pos, entry_len);
+                pos += entry_len;
+            }
+            config.discovery_cache->update_txt(name, txt, rr.ttl, now);
+        }
+    }
+    if (packet.malformed()) s_stats.dropped_malformed++; // Records before the bad one still count
+
+    // Addresses go in after the SRV/TXT records of the same packet, so a
+    // light that describes its service is usable the moment its address
+    // is announced rather than looking like a bare hostname
+    MdnsPacketReader addresses(buf, len);
+    while (addresses.next_record(rr)) {
+        if (rr.type != MDNS_TYPE_A || rr.rdlength != 4) continue;
+        if ((rr.rrclass & ~MDNS_CLASS_FLUSH) != MDNS_CLASS_IN) continue;
+
+        // The IPv4 of the device on the network, keyed by its hostname.
+        // Accepted alongside a watched-service record, or on its own when
+        // it answers a refresh for a hostname we already know.
+        if (!addresses.read_name(rr.name_offset, name)) continue;
+        if (!found_matching_qname && !config.discovery_cache->contains(MDNS_TYPE_A, name)) continue;
+
+        char ipstr[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, addresses.data() + rr.rdata_offset, ipstr, sizeof(ipstr));
+        config.discovery_cache->update(MDNS_TYPE_A, name, ipstr, rr.ttl, now);
+    }
+}
+
+// Per-source token buckets. Each sender may burst SOURCE_BURST packets and
+// is then held to SOURCE_RATE_PER_S; the excess is dropped before parsing,
+// so a device spamming queries costs neither CPU nor transmissions. The
+// least recently seen source is evicted when the table is full.
+struct SourceBucket {
+    in_addr_t addr;
+    uint32_t tokens_milli;  // tokens x 1000, for sub-token refills
+    int64_t last_us;
+    uint32_t dropped;       // packets dropped since this source was last admitted
+};
+static const size_t MAX_TRACKED_SOURCES = 8;
+static const uint32_t SOURCE_BURST = 20;
+static const uint32_t SOURCE_RATE_PER_S = 10;
+static SourceBucket s_sources[MAX_TRACKED_SOURCES] = {};
+
+static bool source_allows(in_addr_t addr, int64_t now) {
+    SourceBucket* bucket = nullptr;
+    SourceBucket* oldest = &s_sources[0];
+    for (auto &entry : s_sources) {
+        if (entry.last_us != 0 && entry.addr == addr) {
+            bucket = &entry;
+            break;
+        }
+        if (entry.last_us < oldest->last_us) oldest = &entry;
+    }
+    if (!bucket) {
+        *oldest = {addr, SOURCE_BURST * 1000, now, 0};
+        bucket = oldest;
+    }
 
-            uint16_t qtype = read_u16(buf + offset); offset += 2;
-            uint16_t qclass = read_u16(buf + offset); offset += 2;
+    int64_t refill = (now - bucket->last_us) * SOURCE_RATE_PER_S / 1000;
+    bucket->tokens_milli = (uint32_t)std::min<int64_t>(bucket->tokens_milli + refill, SOURCE_BURST * 1000);
+    bucket->last_us = now;
 
-            // Check if this is an A record query for our hostname
-            if ((qtype == 1 || qtype == 255) && // A record or ANY
-                (qclass == 1 || qclass == 255) && // IN class or ANY
-                normalize_dns_name(qname_parsed) == normalized_hostname) {
+    if (bucket->tokens_milli < 1000) {
+        if (bucket->dropped++ == 0) {
+            struct in_addr a = {addr};
+            ESP_LOGW(TAG, "Rate limiting mDNS traffic from %s", inet_ntoa(a));
+        }
+        s_stats.dropped_rate_limited++;
+        return false;
+    }
+    if (bucket->dropped > 0) {
+        struct in_addr a = {addr};
+        ESP_LOGW(TAG, "Dropped %lu mDNS packets from %s", (unsigned long)bucket->dropped, inet_ntoa(a));
+        bucket->dropped = 0;
+    }
+    bucket->tokens_milli -= 1000;
+    return true;
+}
 
-                ESP_LOGI(TAG, "Received mDNS A query for %s, responding with %s", qname_parsed.c_str(), our_ip.c_str());
+// Receive and handle every datagram currently queued on the socket.
+static void drain_socket(TaskConfiguration &config) {
+    // Receive buffer lives outside the task stack; only the reactor uses it
+    static uint8_t buf[1500];
 
-                // Send A record response
-                send_mdns_a_record(sock_mdns, our_hostname, our_ip);
-                break; // Done processing this packet
+    // Our own multicasts should not loop back, but lwIP's netif loopback
+    // can still deliver them; drop anything from our own address
+    struct in_addr self;
+    if (inet_pton(AF_INET, config.our_ip.c_str(), &self) != 1) {
+        self.s_addr = htonl(INADDR_ANY);
+    }
+    int64_t now = esp_timer_get_time();
+
+    uint32_t count = 0;
+    while (count < MAX_PACKETS_PER_WAKEUP) {
+        struct sockaddr_in src;
+        socklen_t slen = sizeof(src);
+        ssize_t len = recvfrom(config.sock_mdns, buf, sizeof(buf), MSG_DONTWAIT,
+                               (struct sockaddr*)&src, &slen);
+        if (len < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                s_stats.recv_errors++;
+                ESP_LOGW(TAG, "recvfrom() error: %s", strerror(errno));
             }
+            break;
         }
-    } else if (!is_query) {
-        // This is a response - process answers for service discovery
-        // Skip questions first
-        for (int q = 0; q < qdcount; ++q) {
-            std::string qname_parsed = parse_name(buf, len, offset);
-            if (offset + 4 > (size_t)len) { offset = len; break; }
-            offset += 4; // qtype + qclass
+        count++;
+        if (src.sin_addr.s_addr == self.s_addr) {
+            s_stats.dropped_self++;
+            continue;
         }
+        if (!source_allows(src.sin_addr.s_addr, now)) continue;
+        handle_packet(config, buf, len, src);
+    }
 
-        bool found_matching_qname = false;
-        // Iterate answers + authorities + additionals
-        int rr_total = ancount + nscount + arcount;
-        for (int rr = 0; rr < rr_total; ++rr) {
-            if (offset >= (size_t)len) break;
-            size_t name_off = offset;
-            (void)name_off;
-            std::string name = parse_name(buf, len, offset);
-            if (offset + 10 > (size_t)len) break;
-            uint16_t type = read_u16(buf + offset); offset += 2;
-            uint16_t clas = read_u16(buf + offset); offset += 2;
-            uint32_t ttl = read_u32(buf + offset); offset += 4;
-            (void)ttl;
-            uint16_t rdlen = read_u16(buf + offset); offset += 2;
-
-            found_matching_qname |= (normalize_dns_name(name) == normalized_qname);
-            if (offset + rdlen > (size_t)len) break;
-
-            // We are only interested in the A record, the IPv4 of the device on the network
-            if ((clas == 1 || clas == 32769) && type == 1) { // A
-                if (rdlen == 4) {
-                    char ipstr[INET_ADDRSTRLEN];
-                    inet_ntop(AF_INET, buf + offset, ipstr, sizeof(ipstr));
-
-                    if (found_matching_qname) {
-                        set_ip.insert(std::string(ipstr));
-                    }
-                }
+    if (count == MAX_PACKETS_PER_WAKEUP) {
+        s_stats.drain_cap_hits++; // The rest are read on the next wakeup
+    }
+    s_stats.packets += count;
+    s_stats.last_packets_per_wakeup = count;
+    if (count > s_stats.max_packets_per_wakeup) {
+        s_stats.max_packets_per_wakeup = count;
+    }
+}
+
+static void send_announcement(TaskConfiguration &config) {
+    if (!refresh_prepared_responses(config)) return;
+    ESP_LOGI(TAG, "Sending mDNS announcement for %s", config.mdns_hostname.c_str());
+    send_prepared(config, s_service_response, mdns_multicast_addr());
+    send_prepared(config, s_host_response, mdns_multicast_addr());
+}
+
+// Send the discovery PTR query for the watched service, listing the
+// instances we already know (with their remaining TTL) as Known Answers so
+// those lights stay quiet (RFC 6762 section 7.1). If the list does not fit
+// in one packet, the TC bit is set and the rest follow in further packets
+// carrying only answers (section 7.2).
+static void send_discovery_query(TaskConfiguration &config, int64_t now) {
+    static std::vector<KnownAnswer> known;
+    known.clear();
+    config.discovery_cache->known_answers(now, known);
+
+    size_t next = 0;
+    bool first = true;
+    do {
+        uint8_t buf[MDNS_MAX_TX_PACKET];
+        MdnsPacketWriter query(buf, sizeof(buf));
+        query.header(0, first ? 1 : 0, 0, 0, 0);
+        if (first) {
+            query.put_question(config.qname, MDNS_TYPE_PTR, MDNS_CLASS_IN);
+        }
+
+        uint16_t answers = 0;
+        while (next < known.size()) {
+            MdnsPacketWriter::Mark mark = query.mark();
+            size_t rec = query.begin_record(config.qname, MDNS_TYPE_PTR, MDNS_CLASS_IN, known[next].ttl_remaining_s);
+            query.put_name(known[next].instance);
+            query.end_record(rec);
+            if (!query.ok()) {
+                query.rollback(mark);
+                break;
             }
+            answers++;
+            next++;
+        }
+        if (answers == 0 && next < known.size()) {
+            next++; // A single answer that cannot fit on its own; skip it
+        }
 
-            offset += rdlen;
+        query.patch_u16(6, answers); // ANCOUNT
+        if (next < known.size()) {
+            query.patch_u16(2, MDNS_FLAGS_TC);
+        }
+        if (send_mdns_packet(config.sock_mdns, query) < 0) {
+            s_stats.send_errors++;
+        }
+        first = false;
+    } while (next < known.size());
+
+    ESP_LOGD(TAG, "Sent discovery query with %u known answers", (unsigned)known.size());
+}
+
+// Expire stale discovery records and send the refresh queries that are due.
+static void service_discovery_cache(TaskConfiguration &config, int64_t now) {
+    static std::vector<RefreshQuery> refreshes;
+
+    config.discovery_cache->expire(now);
+
+    refreshes.clear();
+    config.discovery_cache->take_due_refreshes(now, refreshes);
+    for (const auto &refresh : refreshes) {
+        ESP_LOGD(TAG, "Refreshing %s (type %u)", refresh.name.c_str(), refresh.qtype);
+        if (refresh.qtype == MDNS_TYPE_PTR) {
+            send_discovery_query(config, now);
+        } else if (send_mdns_query(config.sock_mdns, refresh.name, refresh.qtype) < 0) {
+            s_stats.send_errors++;
         }
     }
-}
\ No newline at end of file
+}
+
+void mdns_socket_run(TaskConfiguration &config) {
+    const int64_t min_query_interval = 1000000; // 1 s
+    const int64_t max_query_interval = (int64_t)config.max_query_interval_ms * 1000;
+
+    int64_t now = esp_timer_get_time();
+    int64_t next_announce = now;
+    // Continuous querying (RFC 6762 section 5.2): first query after a random
+    // 20-120 ms, then at 1 s, 2 s, 4 s, ... up to the configured cap. The
+    // schedule restarts from 1 s whenever the cache gains or loses a record.
+    int64_t query_interval = min_query_interval;
+    int64_t next_query = now + 20000 + esp_random() % 100000;
+    uint32_t seen_generation = config.discovery_cache->generation();
+
+    while (1) {
+        now = esp_timer_get_time();
+        if (now >= next_announce) {
+            send_announcement(config);
+            next_announce = now + (int64_t)config.announce_interval_ms * 1000;
+        }
+        if (config.discovery_cache->generation() != seen_generation) {
+            seen_generation = config.discovery_cache->generation();
+            query_interval = min_query_interval;
+            next_query = std::min(next_query, now + query_interval);
+        }
+        if (now >= next_query) {
+            send_discovery_query(config, now);
+            next_query = now + query_interval;
+            query_interval = std::min(query_interval * 2, max_query_interval);
+        }
+        if (now >= config.discovery_cache->next_deadline()) {
+            service_discovery_cache(config, now);
+        }
+        flush_pending_responses(config, now);
+
+        // Sleep until the socket is readable or the next timer is due
+        int64_t deadline = std::min<int64_t>({next_announce, next_query, config.discovery_cache->next_deadline(),
+                                              next_pending_deadline()});
+        int64_t wait_us = deadline - esp_timer_get_time();
+        if (wait_us < 0) wait_us = 0;
+        struct timeval tv;
+        tv.tv_sec = wait_us / 1000000;
+        tv.tv_usec = wait_us % 1000000;
+
+        fd_set readfds;
+        FD_ZERO(&readfds);
+        FD_SET(config.sock_mdns, &readfds);
+        int ready = select(config.sock_mdns + 1, &readfds, NULL, NULL, &tv);
+        if (ready < 0) {
+            if (errno != EINTR) {
+                ESP_LOGW(TAG, "select() error: %s", strerror(errno));
+                vTaskDelay(pdMS_TO_TICKS(100));
+            }
+            continue;
+        }
+        if (ready > 0 && FD_ISSET(config.sock_mdns, &readfds)) {
+            s_stats.wakeups++;
+            drain_socket(config);
+        }
+    }
+}
+
+MdnsStats mdns_get_stats() {
+    return s_stats;
+}